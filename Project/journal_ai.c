@@ -4,13 +4,23 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
 
+#undef BLOCK_SIZE   // <linux/fs.h>, pulled in by io_uring.h, has its own
 #define BLOCK_SIZE 4096
 #define FS_MAGIC 0x56534653      
 #define JOURNAL_MAGIC 0x4A524E4C 
+#define FS_STATE_CLEAN 0x434C4E53
+#define FS_FEATURE_FREE_COUNTS 0x1   // free_inodes and free_blocks are maintained
+#define MAX_JOURNAL_BLOCKS (1 + (1U << 31) / BLOCK_SIZE)   // header + 2 GiB log, offsets stay in 32 bits
 #define NAME_LEN 28
 #define INODES_PER_BLOCK (BLOCK_SIZE / 128)
 #define DIRENTS_PER_BLOCK (BLOCK_SIZE / 32)
@@ -26,18 +36,43 @@ struct superblock {
     uint32_t data_bitmap;   // data bitmap block
     uint32_t inode_start;   // first inode block
     uint32_t data_start;    // first data block
-    uint8_t  _pad[128 - 9 * 4]; // padding to 128 bytes
+    uint32_t state;         // FS_STATE_CLEAN when the journal holds nothing to install
+    uint32_t features;      // FS_FEATURE_* flags
+    uint32_t free_inodes;   // unallocated inodes, journaled with every allocation
+    uint32_t free_blocks;   // unallocated data blocks, likewise
+    uint8_t  _pad[128 - 13 * 4]; // padding to 128 bytes
 };
 
 
+/*
+ * With INODE_EXTENTS set, the direct pointer area holds up to four extents
+ * in file order, and extent_block may name a data block holding up to 512
+ * more. A zero length ends the list. Inodes without the flag use direct
+ * pointers, as mkfs creates the root directory.
+ */
+struct extent {
+    uint32_t start;         // first disk block
+    uint32_t length;        // blocks; 0 = unused
+};
+
+#define INODE_EXTENTS 0x1
+#define INODE_DIRECT_EXTENTS 4
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / sizeof(struct extent))
+#define INODE_MAX_EXTENTS (INODE_DIRECT_EXTENTS + EXTENTS_PER_BLOCK)
+
 struct inode {
     uint16_t type;          // 0=free,1=file,2=dir
     uint16_t links;         // link count
     uint32_t size;          // file size bytes
-    uint32_t direct[8];     // 8 direct pointers
+    union {
+        uint32_t direct[8];     // 8 direct pointers
+        struct extent extents[INODE_DIRECT_EXTENTS];
+    };
     uint32_t ctime;         // creation time
     uint32_t mtime;         // modification time
-    uint8_t  _pad[128 - (2+2+4 + 8*4 + 4+4)]; // padding to 128 bytes
+    uint32_t flags;         // INODE_EXTENTS
+    uint32_t extent_block;  // indirect extent block, 0 if none
+    uint8_t  _pad[128 - (2+2+4 + 8*4 + 4+4 + 4+4)]; // padding to 128 bytes
 };
 
 
@@ -47,17 +82,38 @@ struct dirent {
 };
 
 
+/*
+ * The journal region is sb->journal_block .. sb->inode_bitmap - 1. Its first
+ * block holds the header; the remaining blocks form a circular log addressed
+ * by byte offset. Committed transactions live between head and tail until a
+ * checkpoint (install) copies them home. Transactions are packed back to
+ * back (records are 4-byte aligned) and never wrap: if one does not fit
+ * before the end of the log a REC_WRAP marker is left at the old tail and
+ * the transaction starts at 0.
+ *
+ * Each commit record carries the transaction's sequence number and a CRC32C
+ * of its records, so a commit is one write plus one flush and the header is
+ * only rewritten at checkpoint. Opening the journal scans forward from head
+ * for transactions that verify; the first one that does not (stale data or
+ * a transaction torn by a crash) is the real tail.
+ */
 struct journal_header {
     uint32_t magic;         // JOURNAL_MAGIC
-    uint32_t nbytes_used;   // bytes used; empty when == sizeof(header)
-    uint8_t  _pad[BLOCK_SIZE - 8]; // rest of block reserved
+    uint32_t nbytes_used;   // live log bytes from head to tail; empty when == 0
+    uint32_t head;          // log offset of oldest un-checkpointed transaction
+    uint32_t tail;          // log offset where the next transaction goes
+    uint32_t head_seq;      // sequence number of the transaction at head
+    uint32_t tail_seq;      // sequence number the next transaction gets
+    uint8_t  _pad[BLOCK_SIZE - 24]; // rest of block reserved
 };
 
 #define REC_DATA 1
 #define REC_COMMIT 2
+#define REC_WRAP 3
+#define REC_DELTA 4
 
 struct rec_header {
-    uint16_t type;   // REC_DATA or REC_COMMIT
+    uint16_t type;   // REC_DATA, REC_COMMIT, REC_WRAP or REC_DELTA
     uint16_t size;   // total size of this record in bytes
 };
 
@@ -67,151 +123,895 @@ struct data_record {
     uint8_t data[BLOCK_SIZE];    // full block image
 };
 
+/*
+ * Patches one byte range of a block. Replay applies it on top of whatever
+ * the home block holds at that point, which is exactly the image it was
+ * diffed against because transactions are replayed in log order.
+ */
+struct delta_record {
+    struct rec_header hdr;       // REC_DELTA; size is padded to 4 bytes
+    uint32_t block_no;           // destination/home block number
+    uint16_t offset;             // first changed byte within the block
+    uint16_t length;             // number of changed bytes in data
+    uint8_t data[];              // new contents of the range
+};
+
 struct commit_record {
     struct rec_header hdr;       // REC_COMMIT
+    uint32_t seq;                // transaction sequence number
+    uint32_t checksum;           // CRC32C of the records and seq
+};
+
+struct wrap_record {
+    struct rec_header hdr;       // REC_WRAP: rest of the log is unused
+    uint32_t seq;                // transaction that continues at offset 0
 };
 
 
 int disk_fd = -1;
 
+/*
+ * --sync picks how many flushes a commit pays for:
+ *   none    no flushes at all; a crash can lose or tear anything since the
+ *           last clean shutdown (bulk loads that can be redone)
+ *   commit  file data, then records and commit record in one write, then a
+ *           flush; the commit checksum catches a torn record write. Install
+ *           flushes home blocks before clearing the log (default)
+ *   full    as commit, but the records are flushed before the commit record
+ *           is written, and install also flushes the cleared header
+ */
+#define SYNC_NONE 0
+#define SYNC_COMMIT 1
+#define SYNC_FULL 2
+
+int sync_mode = SYNC_COMMIT;
+const char *sync_mode_names[] = { "none", "commit", "full" };
+
+/* ===================== I/O Statistics ===================== */
+
+/*
+ * With --stats, the device layer counts every block, byte and syscall that
+ * reaches the image, and the time spent waiting in them. The main phases of
+ * a command are timed too: wall time, plus the device time of the thread
+ * running the phase. A phase whose time is mostly device time was stalled
+ * on I/O; one with little device time was CPU-bound. Everything is dumped
+ * as one JSON object at exit. Phases can nest: a checkpoint forced by a
+ * full log runs inside journal_append. With stats off, only the counter
+ * adds remain.
+ */
+enum stat_phase {
+    PHASE_JOURNAL_APPEND,   // merge, diff and queue a transaction's records
+    PHASE_COMMIT,           // wait for (or lead) the group write
+    PHASE_REPLAY,           // read and scan the log
+    PHASE_INSTALL,          // checkpoint the log home
+    PHASE_DIR_SCAN,         // load the root directory index
+    NPHASES
+};
+
+const char *stat_phase_names[NPHASES] = { "journal_append", "commit", "replay", "install", "dir_scan" };
+
+struct io_stats {
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t read_calls;        // pread and friends
+    uint64_t write_calls;       // pwrite, pwritev
+    uint64_t flushes;           // fdatasync or msync, queued or not
+    uint64_t ring_enters;       // io_uring_enter calls
+    uint64_t device_ns;         // time inside those syscalls, summed over threads
+    struct {
+        uint64_t count;
+        uint64_t ns;
+        uint64_t device_ns;
+    } phase[NPHASES];
+};
+
+int stats_enabled = 0;
+struct io_stats io_stats;
+__thread uint64_t thread_device_ns;
+
+struct phase_timer {
+    enum stat_phase phase;
+    uint64_t start_ns;
+    uint64_t start_device_ns;
+};
+
+uint64_t stats_clock(void) {
+    if (!stats_enabled) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Books time spent in the device since start (a stats_clock value)
+void stats_device_time(uint64_t start) {
+    if (!start) return;
+    uint64_t ns = stats_clock() - start;
+    thread_device_ns += ns;
+    __atomic_fetch_add(&io_stats.device_ns, ns, __ATOMIC_RELAXED);
+}
+
+// Counts bytes moved to or from the image by calls syscalls (0 if queued or mapped)
+void stats_io(int write, uint64_t bytes, uint64_t calls, uint64_t start) {
+    uint64_t blocks = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (write) {
+        __atomic_fetch_add(&io_stats.blocks_written, blocks, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&io_stats.bytes_written, bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&io_stats.write_calls, calls, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&io_stats.blocks_read, blocks, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&io_stats.bytes_read, bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&io_stats.read_calls, calls, __ATOMIC_RELAXED);
+    }
+    stats_device_time(start);
+}
+
+void phase_begin(struct phase_timer *t, enum stat_phase phase) {
+    t->phase = phase;
+    t->start_ns = stats_clock();
+    t->start_device_ns = thread_device_ns;
+}
+
+void phase_end(const struct phase_timer *t) {
+    if (!t->start_ns) return;
+    __atomic_fetch_add(&io_stats.phase[t->phase].count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&io_stats.phase[t->phase].ns, stats_clock() - t->start_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&io_stats.phase[t->phase].device_ns, thread_device_ns - t->start_device_ns,
+                       __ATOMIC_RELAXED);
+}
+
+/* ===================== io_uring Backend ===================== */
+
+/*
+ * Batched block I/O through an io_uring ring, set up with raw syscalls.
+ * Callers queue reads, writes and flushes, and io_submit_wait hands the
+ * whole batch to the kernel with one io_uring_enter, then reaps every
+ * completion. A flush is queued as a drain: it starts once everything
+ * queued before it is done, and nothing queued after it starts until it
+ * is. Buffers registered with uring_register go out as fixed I/O, so their
+ * pages are not pinned again for every request.
+ *
+ * With --io=sync, or when the kernel will not set up a ring, each request
+ * runs as the matching synchronous syscall when it is queued, and
+ * io_submit_wait has nothing left to do. uring_lock covers the ring. The
+ * thread that submits reaps everything in flight, so whoever returns from
+ * io_submit_wait finds its own requests done.
+ */
+#define URING_ENTRIES 64
+#define URING_MAX_FIXED 2
+
+struct uring_op {
+    int busy;
+    size_t expected;        // bytes the request must move
+    const char *who;
+};
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned entries;
+    unsigned queued;        // filled in, not yet submitted
+    unsigned inflight;      // submitted, not yet reaped
+    struct iovec fixed[URING_MAX_FIXED];
+    int nfixed;
+    struct uring_op ops[URING_ENTRIES];
+};
+
+int disk_use_uring = 1;     // cleared by --io=sync or a failed setup
+struct uring disk_ring = { .fd = -1 };
+pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int uring_setup(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return -1;
+
+    r->entries = p.sq_entries < URING_ENTRIES ? p.sq_entries : URING_ENTRIES;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            munmap(r->sq_ring, r->sq_ring_size);
+            goto fail;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+        munmap(r->sq_ring, r->sq_ring_size);
+        goto fail;
+    }
+
+    uint8_t *sq = r->sq_ring;
+    uint8_t *cq = r->cq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    close(r->fd);
+    r->fd = -1;
+    return -1;
+}
+
+void uring_exit(struct uring *r) {
+    if (r->fd < 0) return;
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    r->fd = -1;
+}
+
+// Registers bufs for fixed I/O; without them, I/O just goes unregistered
+void uring_register(struct uring *r, const struct iovec *bufs, int nbufs) {
+    if (r->fd < 0 || r->nfixed > 0 || nbufs > URING_MAX_FIXED) return;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, bufs, nbufs) == 0) {
+        memcpy(r->fixed, bufs, nbufs * sizeof(struct iovec));
+        r->nfixed = nbufs;
+    }
+}
+
+// Index of the registered buffer holding [buf, buf + len), or -1
+int uring_fixed_index(const struct uring *r, const void *buf, size_t len) {
+    for (int i = 0; i < r->nfixed; i++) {
+        const uint8_t *base = r->fixed[i].iov_base;
+        if ((const uint8_t *)buf >= base && (const uint8_t *)buf + len <= base + r->fixed[i].iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Moves queued requests to the kernel; waits for at least min_complete of them
+void uring_enter(struct uring *r, unsigned min_complete) {
+    if (r->queued == 0 && min_complete == 0) return;
+    do {
+        uint64_t start = stats_clock();
+        int n = (int)syscall(__NR_io_uring_enter, r->fd, r->queued, min_complete,
+                             min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        __atomic_fetch_add(&io_stats.ring_enters, 1, __ATOMIC_RELAXED);
+        stats_device_time(start);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        r->queued -= (unsigned)n;
+        r->inflight += (unsigned)n;
+    } while (r->queued > 0);
+}
+
+// Takes every completion the kernel has posted; a failed or short request is fatal
+void uring_reap(struct uring *r) {
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        struct uring_op *op = &r->ops[cqe->user_data];
+        if (cqe->res < 0 || (size_t)cqe->res != op->expected) {
+            fprintf(stderr, "%s: expected %zu bytes, got %d: %s\n", op->who, op->expected, cqe->res,
+                    cqe->res < 0 ? strerror(-cqe->res) : "short transfer");
+            exit(1);
+        }
+        op->busy = 0;
+        r->inflight--;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Submits everything queued and returns once all of it has completed
+void uring_wait_all(struct uring *r) {
+    uring_enter(r, 0);
+    while (r->inflight > 0) {
+        uring_reap(r);
+        if (r->inflight > 0) uring_enter(r, 1);
+    }
+}
+
+// Next free submission entry, zeroed, with its request slot filled in
+struct io_uring_sqe *uring_get_sqe(struct uring *r, size_t expected, const char *who) {
+    if (r->queued + r->inflight == r->entries) uring_wait_all(r);
+    unsigned slot = 0;
+    while (r->ops[slot].busy) slot++;
+    r->ops[slot] = (struct uring_op){ 1, expected, who };
+
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = disk_fd;
+    sqe->user_data = slot;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+    return sqe;
+}
+
+/*
+ * Queues a write of iov to consecutive blocks from block_num. The buffers
+ * and the iov array itself must stay put until io_submit_wait returns.
+ */
+void io_queue_write(uint32_t block_num, const struct iovec *iov, int iovcnt, const char *who) {
+    size_t expected = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        expected += iov[i].iov_len;
+    }
+    off_t offset = (off_t)block_num * (off_t)BLOCK_SIZE;
+    if (!disk_use_uring) {
+        uint64_t start = stats_clock();
+        ssize_t w = pwritev(disk_fd, iov, iovcnt, offset);
+        if (w != (ssize_t)expected) {
+            fprintf(stderr, "%s: expected %zu bytes, wrote %zd: %s\n",
+                    who, expected, w, (w < 0 ? strerror(errno) : "short write"));
+            exit(1);
+        }
+        stats_io(1, expected, 1, start);
+        return;
+    }
+    stats_io(1, expected, 0, 0);
+
+    pthread_mutex_lock(&uring_lock);
+    struct io_uring_sqe *sqe = uring_get_sqe(&disk_ring, expected, who);
+    int fixed = iovcnt == 1 ? uring_fixed_index(&disk_ring, iov[0].iov_base, expected) : -1;
+    sqe->off = (uint64_t)offset;
+    if (fixed >= 0) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->addr = (uint64_t)(uintptr_t)iov[0].iov_base;
+        sqe->len = (uint32_t)expected;
+        sqe->buf_index = (uint16_t)fixed;
+    } else {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (uint64_t)(uintptr_t)iov;
+        sqe->len = (uint32_t)iovcnt;
+    }
+    pthread_mutex_unlock(&uring_lock);
+}
+
+// Queues a read of nblocks consecutive blocks into buf, which must stay put until io_submit_wait returns
+void io_queue_read(uint32_t block_num, void *buf, uint32_t nblocks, const char *who) {
+    size_t expected = (size_t)nblocks * BLOCK_SIZE;
+    off_t offset = (off_t)block_num * (off_t)BLOCK_SIZE;
+    if (!disk_use_uring) {
+        uint64_t start = stats_clock();
+        ssize_t r = pread(disk_fd, buf, expected, offset);
+        if (r != (ssize_t)expected) {
+            fprintf(stderr, "%s: expected %zu bytes, got %zd: %s\n",
+                    who, expected, r, (r < 0 ? strerror(errno) : "short read"));
+            exit(1);
+        }
+        stats_io(0, expected, 1, start);
+        return;
+    }
+    stats_io(0, expected, 0, 0);
+
+    pthread_mutex_lock(&uring_lock);
+    struct io_uring_sqe *sqe = uring_get_sqe(&disk_ring, expected, who);
+    int fixed = uring_fixed_index(&disk_ring, buf, expected);
+    sqe->opcode = fixed >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)expected;
+    sqe->off = (uint64_t)offset;
+    if (fixed >= 0) sqe->buf_index = (uint16_t)fixed;
+    pthread_mutex_unlock(&uring_lock);
+}
+
+// Queues fdatasync as a barrier between what was queued before and after it
+void io_queue_flush(void) {
+    __atomic_fetch_add(&io_stats.flushes, 1, __ATOMIC_RELAXED);
+    if (!disk_use_uring) {
+        uint64_t start = stats_clock();
+        if (fdatasync(disk_fd) < 0) {
+            fprintf(stderr, "fdatasync failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        stats_device_time(start);
+        return;
+    }
+
+    pthread_mutex_lock(&uring_lock);
+    struct io_uring_sqe *sqe = uring_get_sqe(&disk_ring, 0, "fdatasync");
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->flags = IOSQE_IO_DRAIN;
+    pthread_mutex_unlock(&uring_lock);
+}
+
+// Submits everything queued with one io_uring_enter and waits for all of it
+void io_submit_wait(void) {
+    if (!disk_use_uring) return;
+    pthread_mutex_lock(&uring_lock);
+    uring_wait_all(&disk_ring);
+    pthread_mutex_unlock(&uring_lock);
+}
+
+/*
+ * With --mmap the whole image is mapped and block I/O turns into memcpy on
+ * the mapping; the block cache is bypassed since the page cache already is
+ * one. Dirty ranges are msync'd wherever the cache would have been flushed.
+ */
+int disk_use_mmap = 0;
+uint8_t *disk_map = NULL;
+size_t disk_map_size = 0;
+uint32_t map_dirty_lo = UINT32_MAX;   // dirty block range awaiting msync
+uint32_t map_dirty_hi = 0;
+
+void bcache_flush(void);
+
 void open_disk(const char *filename) {
     disk_fd = open(filename, O_RDWR);
     if (disk_fd < 0) {
         fprintf(stderr, "open_disk(%s) failed: %s\n", filename, strerror(errno));
         exit(1);
     }
+    if (disk_use_mmap) {
+        struct stat st;
+        if (fstat(disk_fd, &st) < 0 || st.st_size < (off_t)BLOCK_SIZE) {
+            fprintf(stderr, "open_disk(%s): cannot size image for mmap\n", filename);
+            exit(1);
+        }
+        disk_map_size = (size_t)st.st_size;
+        disk_map = mmap(NULL, disk_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+        if (disk_map == MAP_FAILED) {
+            fprintf(stderr, "open_disk(%s): mmap failed: %s\n", filename, strerror(errno));
+            exit(1);
+        }
+    }
+    if (disk_map || (disk_use_uring && uring_setup(&disk_ring, URING_ENTRIES) < 0)) {
+        disk_use_uring = 0;
+    }
 }
 
 void close_disk() {
     if (disk_fd >= 0) {
+        bcache_flush();
+        if (disk_map) {
+            munmap(disk_map, disk_map_size);
+            disk_map = NULL;
+        }
+        uring_exit(&disk_ring);
         close(disk_fd);
         disk_fd = -1;
     }
 }
 
 
-void read_block_raw(uint32_t block_num, void *buffer) {
-    off_t offset = (off_t)block_num * (off_t)BLOCK_SIZE;
-    if (lseek(disk_fd, offset, SEEK_SET) == (off_t)-1) {
-        fprintf(stderr, "lseek read_block_raw failed: %s\n", strerror(errno));
+// Bounds-checked address of a block range inside the mapping
+uint8_t *map_blocks(uint32_t block_num, size_t nbytes, const char *who) {
+    size_t offset = (size_t)block_num * BLOCK_SIZE;
+    if (offset > disk_map_size || nbytes > disk_map_size - offset) {
+        fprintf(stderr, "%s: block %u is past the end of the image\n", who, block_num);
+        exit(1);
+    }
+    return disk_map + offset;
+}
+
+void map_mark_dirty(uint32_t block_num, uint32_t nblocks) {
+    if (block_num < map_dirty_lo) map_dirty_lo = block_num;
+    if (block_num + nblocks > map_dirty_hi) map_dirty_hi = block_num + nblocks;
+}
+
+void map_sync(void) {
+    if (map_dirty_lo >= map_dirty_hi) return;
+    size_t offset = (size_t)map_dirty_lo * BLOCK_SIZE;
+    size_t len = (size_t)(map_dirty_hi - map_dirty_lo) * BLOCK_SIZE;
+    uint64_t start = stats_clock();
+    if (msync(disk_map + offset, len, sync_mode == SYNC_NONE ? MS_ASYNC : MS_SYNC) < 0) {
+        fprintf(stderr, "msync failed: %s\n", strerror(errno));
         exit(1);
     }
-    ssize_t r = read(disk_fd, buffer, BLOCK_SIZE);
+    __atomic_fetch_add(&io_stats.flushes, 1, __ATOMIC_RELAXED);
+    stats_device_time(start);
+    map_dirty_lo = UINT32_MAX;
+    map_dirty_hi = 0;
+}
+
+
+void dev_read_block(uint32_t block_num, void *buffer) {
+    if (disk_map) {
+        memcpy(buffer, map_blocks(block_num, BLOCK_SIZE, "read_block_raw"), BLOCK_SIZE);
+        stats_io(0, BLOCK_SIZE, 0, 0);
+        return;
+    }
+    off_t offset = (off_t)block_num * (off_t)BLOCK_SIZE;
+    uint64_t start = stats_clock();
+    ssize_t r = pread(disk_fd, buffer, BLOCK_SIZE, offset);
     if (r != (ssize_t)BLOCK_SIZE) {
         fprintf(stderr, "read_block_raw: expected %d bytes, got %zd: %s\n",
                 BLOCK_SIZE, r, (r < 0 ? strerror(errno) : "short read"));
         exit(1);
     }
+    stats_io(0, BLOCK_SIZE, 1, start);
 }
 
 
-void write_block_raw(uint32_t block_num, const void *buffer) {
-    off_t offset = (off_t)block_num * (off_t)BLOCK_SIZE;
-    if (lseek(disk_fd, offset, SEEK_SET) == (off_t)-1) {
-        fprintf(stderr, "lseek write_block_raw failed: %s\n", strerror(errno));
-        exit(1);
+void dev_write_block(uint32_t block_num, const void *buffer) {
+    if (disk_map) {
+        memcpy(map_blocks(block_num, BLOCK_SIZE, "write_block_raw"), buffer, BLOCK_SIZE);
+        map_mark_dirty(block_num, 1);
+        stats_io(1, BLOCK_SIZE, 0, 0);
+        return;
     }
-    ssize_t w = write(disk_fd, buffer, BLOCK_SIZE);
+    off_t offset = (off_t)block_num * (off_t)BLOCK_SIZE;
+    uint64_t start = stats_clock();
+    ssize_t w = pwrite(disk_fd, buffer, BLOCK_SIZE, offset);
     if (w != (ssize_t)BLOCK_SIZE) {
         fprintf(stderr, "write_block_raw: expected %d bytes, wrote %zd: %s\n",
                 BLOCK_SIZE, w, (w < 0 ? strerror(errno) : "short write"));
         exit(1);
     }
+    stats_io(1, BLOCK_SIZE, 1, start);
 }
 
 
-void read_superblock(struct superblock *sb) {
-    uint8_t buf[BLOCK_SIZE];
-    read_block_raw(0, buf);
-    memcpy(sb, buf, sizeof(struct superblock));
+/* ===================== Block Cache ===================== */
+
+/*
+ * Small write-back LRU cache between the FS code and the image. Writes only
+ * mark a block dirty; bcache_flush pushes dirty blocks out in block order and
+ * is called wherever ordering matters (commit, checkpoint, close). One lock
+ * covers the cache and the mapping's dirty range; the I/O of a vectored
+ * write runs outside it.
+ */
+#define BCACHE_BLOCKS 64
+
+struct cached_block {
+    uint32_t block_no;
+    int      valid;
+    int      dirty;
+    int      pins;          // pinned blocks are never evicted
+    uint64_t last_used;     // LRU clock value of the last access
+    uint8_t  data[BLOCK_SIZE];
+};
+
+struct block_cache {
+    struct cached_block slots[BCACHE_BLOCKS];
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writebacks;
+};
+
+struct block_cache bcache;
+pthread_mutex_t bcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct cached_block *bcache_lookup(uint32_t block_num) {
+    for (int i = 0; i < BCACHE_BLOCKS; i++) {
+        if (bcache.slots[i].valid && bcache.slots[i].block_no == block_num) {
+            return &bcache.slots[i];
+        }
+    }
+    return NULL;
+}
+
+void bcache_writeback(struct cached_block *cb) {
+    if (cb->valid && cb->dirty) {
+        dev_write_block(cb->block_no, cb->data);
+        cb->dirty = 0;
+        bcache.writebacks++;
+    }
 }
 
+/*
+ * Returns block_num pinned in the cache. With load == 0 the caller is about
+ * to overwrite the whole block, so a miss skips the device read.
+ */
+struct cached_block *bcache_get(uint32_t block_num, int load) {
+    struct cached_block *cb = bcache_lookup(block_num);
+    if (cb) {
+        bcache.hits++;
+    } else {
+        // Prefer an empty slot, otherwise evict the least recently used one
+        struct cached_block *victim = NULL;
+        for (int i = 0; i < BCACHE_BLOCKS; i++) {
+            struct cached_block *slot = &bcache.slots[i];
+            if (slot->pins > 0) continue;
+            if (!slot->valid) {
+                victim = slot;
+                break;
+            }
+            if (!victim || slot->last_used < victim->last_used) {
+                victim = slot;
+            }
+        }
+        if (!victim) {
+            fprintf(stderr, "bcache_get: all %d cache blocks are pinned\n", BCACHE_BLOCKS);
+            exit(1);
+        }
+        bcache_writeback(victim);
 
-void read_bitmap_block(uint32_t bitmap_block_no, uint8_t *bitmap_out) {
-    read_block_raw(bitmap_block_no, bitmap_out);
+        cb = victim;
+        cb->block_no = block_num;
+        cb->valid = 1;
+        cb->dirty = 0;
+        if (load) {
+            dev_read_block(block_num, cb->data);
+            bcache.misses++;
+        }
+    }
+    cb->pins++;
+    cb->last_used = ++bcache.clock;
+    return cb;
 }
 
+void bcache_put(struct cached_block *cb, int dirty) {
+    if (dirty) cb->dirty = 1;
+    cb->pins--;
+}
 
-void write_bitmap_block(uint32_t bitmap_block_no, const uint8_t *bitmap_in) {
-    write_block_raw(bitmap_block_no, bitmap_in);
+/*
+ * Writes every dirty block back in ascending block order, neighbours as one
+ * vectored write, followed by a device flush if flush is set. It all goes
+ * to the kernel as one batch.
+ */
+void bcache_writeback_all(int flush) {
+    pthread_mutex_lock(&bcache_lock);
+    if (disk_map) {
+        map_sync();
+        pthread_mutex_unlock(&bcache_lock);
+        return;
+    }
+    struct cached_block *dirty[BCACHE_BLOCKS];
+    struct iovec iov[BCACHE_BLOCKS];
+    int ndirty = 0;
+    for (;;) {
+        struct cached_block *next = NULL;
+        for (int i = 0; i < BCACHE_BLOCKS; i++) {
+            struct cached_block *cb = &bcache.slots[i];
+            if (cb->valid && cb->dirty && (!next || cb->block_no < next->block_no)) {
+                next = cb;
+            }
+        }
+        if (!next) break;
+        next->dirty = 0;
+        bcache.writebacks++;
+        iov[ndirty].iov_base = next->data;
+        iov[ndirty].iov_len = BLOCK_SIZE;
+        dirty[ndirty++] = next;
+    }
+    for (int i = 0; i < ndirty; ) {
+        int n = 1;
+        while (i + n < ndirty && dirty[i + n]->block_no == dirty[i]->block_no + (uint32_t)n) n++;
+        io_queue_write(dirty[i]->block_no, &iov[i], n, "bcache_flush");
+        i += n;
+    }
+    if (flush) io_queue_flush();
+    io_submit_wait();
+    pthread_mutex_unlock(&bcache_lock);
 }
 
+void bcache_flush(void) {
+    bcache_writeback_all(0);
+}
 
-int check_bit(const uint8_t *bitmap, int index) {
-    int byte_idx = index / 8;
-    int bit_idx = index % 8;
-    return (bitmap[byte_idx] & (1 << bit_idx)) != 0;
+// Drops cached copies of blocks that were just written around the cache
+void bcache_invalidate(uint32_t first_block, uint32_t nblocks) {
+    for (int i = 0; i < BCACHE_BLOCKS; i++) {
+        struct cached_block *cb = &bcache.slots[i];
+        if (cb->valid && cb->block_no >= first_block && cb->block_no - first_block < nblocks) {
+            cb->valid = 0;
+            cb->dirty = 0;
+        }
+    }
 }
 
-void set_bit(uint8_t *bitmap, int index) {
-    int byte_idx = index / 8;
-    int bit_idx = index % 8;
-    bitmap[byte_idx] |= (1 << bit_idx);
+
+/*
+ * Makes everything written so far durable: queued writes and cache
+ * write-back, then one flush, submitted together.
+ */
+void sync_disk(void) {
+    bcache_writeback_all(sync_mode != SYNC_NONE);
 }
 
-void clear_bit(uint8_t *bitmap, int index) {
-    int byte_idx = index / 8;
-    int bit_idx = index % 8;
-    bitmap[byte_idx] &= ~(1 << bit_idx);
+
+void read_block_raw(uint32_t block_num, void *buffer) {
+    if (disk_map) {
+        dev_read_block(block_num, buffer);
+        return;
+    }
+    pthread_mutex_lock(&bcache_lock);
+    struct cached_block *cb = bcache_get(block_num, 1);
+    memcpy(buffer, cb->data, BLOCK_SIZE);
+    bcache_put(cb, 0);
+    pthread_mutex_unlock(&bcache_lock);
 }
 
 
-int find_free_bit(const uint8_t *bitmap, int size_in_bits) {
-    for (int i = 0; i < size_in_bits; i++) {
-        if (!check_bit(bitmap, i)) return i;
+// Like read_block_raw, but a miss is queued; buffer is filled once io_submit_wait returns
+void read_block_queue(uint32_t block_num, void *buffer) {
+    if (disk_map) {
+        dev_read_block(block_num, buffer);
+        return;
     }
-    return -1;
+    pthread_mutex_lock(&bcache_lock);
+    struct cached_block *cb = bcache_lookup(block_num);
+    if (cb) memcpy(buffer, cb->data, BLOCK_SIZE);
+    pthread_mutex_unlock(&bcache_lock);
+    if (!cb) io_queue_read(block_num, buffer, 1, "read_block_raw");
 }
 
 
-/* ===================== PHASE 2: FS Reader Functions ===================== */
+void write_block_raw(uint32_t block_num, const void *buffer) {
+    pthread_mutex_lock(&bcache_lock);
+    if (disk_map) {
+        dev_write_block(block_num, buffer);
+    } else {
+        struct cached_block *cb = bcache_get(block_num, 0);
+        memcpy(cb->data, buffer, BLOCK_SIZE);
+        bcache_put(cb, 1);
+    }
+    pthread_mutex_unlock(&bcache_lock);
+}
 
-void read_inode(const struct superblock *sb, uint32_t inum, struct inode *inode_out) {
-    uint32_t inodes_per_block = BLOCK_SIZE / sizeof(struct inode);
-    uint32_t block_index = inum / inodes_per_block;
-    uint32_t offset_in_block = inum % inodes_per_block;
-    
-    uint8_t block_buf[BLOCK_SIZE];
-    read_block_raw(sb->inode_start + block_index, block_buf);
-    
-    memcpy(inode_out, block_buf + offset_in_block * sizeof(struct inode), sizeof(struct inode));
+
+/*
+ * Queues iov for consecutive blocks starting at block_num as one request.
+ * Buffers and iov must stay put until the next io_submit_wait or sync_disk.
+ */
+void write_blocks_queue(uint32_t block_num, const struct iovec *iov, int iovcnt) {
+    size_t expected = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        expected += iov[i].iov_len;
+    }
+    uint32_t nblocks = (uint32_t)((expected + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    if (disk_map) {
+        uint8_t *dst = map_blocks(block_num, expected, "write_blocks_raw");
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+            dst += iov[i].iov_len;
+        }
+        pthread_mutex_lock(&bcache_lock);
+        map_mark_dirty(block_num, nblocks);
+        pthread_mutex_unlock(&bcache_lock);
+        stats_io(1, expected, 0, 0);
+        return;
+    }
+    pthread_mutex_lock(&bcache_lock);
+    bcache_invalidate(block_num, nblocks);
+    pthread_mutex_unlock(&bcache_lock);
+    io_queue_write(block_num, iov, iovcnt, "write_blocks_raw");
 }
 
-void write_inode_to_buffer(uint8_t *block_buf, uint32_t offset_in_block, const struct inode *inode_in) {
-    memcpy(block_buf + offset_in_block * sizeof(struct inode), inode_in, sizeof(struct inode));
+// Gathers iov into consecutive blocks starting at block_num with one request, and waits for it
+void write_blocks_raw(uint32_t block_num, const struct iovec *iov, int iovcnt) {
+    write_blocks_queue(block_num, iov, iovcnt);
+    io_submit_wait();
 }
 
-int find_free_inode(const struct superblock *sb, const uint8_t *inode_bitmap) {
-    for (uint32_t i = 0; i < sb->inode_count; i++) {
-        if (!check_bit(inode_bitmap, i)) {
-            return i;
+/*
+ * Reads nblocks consecutive blocks, split into requests that the ring runs
+ * side by side. Cached copies are newer than or equal to the device, so
+ * they win over what was read.
+ */
+#define READ_RUN_BLOCKS 256
+
+void read_blocks_raw(uint32_t block_num, uint32_t nblocks, void *buffer) {
+    if (disk_map) {
+        memcpy(buffer, map_blocks(block_num, (size_t)nblocks * BLOCK_SIZE, "read_blocks_raw"),
+               (size_t)nblocks * BLOCK_SIZE);
+        stats_io(0, (size_t)nblocks * BLOCK_SIZE, 0, 0);
+        return;
+    }
+    uint8_t *out = buffer;
+    for (uint32_t done = 0; done < nblocks; ) {
+        uint32_t n = nblocks - done < READ_RUN_BLOCKS ? nblocks - done : READ_RUN_BLOCKS;
+        io_queue_read(block_num + done, out + (size_t)done * BLOCK_SIZE, n, "read_blocks_raw");
+        done += n;
+    }
+    io_submit_wait();
+
+    pthread_mutex_lock(&bcache_lock);
+    for (int i = 0; i < BCACHE_BLOCKS; i++) {
+        struct cached_block *cb = &bcache.slots[i];
+        if (cb->valid && cb->block_no >= block_num && cb->block_no - block_num < nblocks) {
+            memcpy(out + (size_t)(cb->block_no - block_num) * BLOCK_SIZE, cb->data, BLOCK_SIZE);
         }
     }
-    return -1;
+    pthread_mutex_unlock(&bcache_lock);
 }
 
-int find_free_dirent_slot(const uint8_t *dir_block) {
-    const struct dirent *entries = (const struct dirent *)dir_block;
-    for (int i = 0; i < DIRENTS_PER_BLOCK; i++) {
-        if (entries[i].inode == 0) {
-            return i;
+
+void read_superblock(struct superblock *sb) {
+    uint8_t buf[BLOCK_SIZE];
+    read_block_raw(0, buf);
+    memcpy(sb, buf, sizeof(struct superblock));
+}
+
+
+/* ===================== CRC32C ===================== */
+
+#define CRC32C_INIT 0xFFFFFFFFU
+
+uint32_t crc32c_table[256];
+
+uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    if (crc32c_table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78U : c >> 1;
+            }
+            crc32c_table[i] = c;
         }
     }
-    return -1;
+    while (len--) {
+        crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
 }
 
-int find_dirent_by_name(const uint8_t *dir_block, const char *name) {
-    const struct dirent *entries = (const struct dirent *)dir_block;
-    for (int i = 0; i < DIRENTS_PER_BLOCK; i++) {
-        if (entries[i].inode != 0 && strncmp(entries[i].name, name, NAME_LEN) == 0) {
-            return i;
-        }
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        c = __builtin_ia32_crc32di(c, word);
+        p += 8;
+        len -= 8;
     }
-    return -1;
+    crc = (uint32_t)c;
+    while (len--) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+// Running CRC32C: start from CRC32C_INIT and invert the final value
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len) {
+#if defined(__x86_64__)
+    static int have_sse42 = -1;
+    if (have_sse42 < 0) {
+        have_sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    }
+    if (have_sse42) {
+        return crc32c_hw(crc, buf, len);
+    }
+#endif
+    return crc32c_sw(crc, buf, len);
 }
 
 
-/* ===================== PHASE 3: Journal Functions ===================== */
+/* ===================== Journal Log Area ===================== */
+
+uint32_t journal_capacity(const struct superblock *sb) {
+    // Everything between the header block and the inode bitmap is log space
+    return (sb->inode_bitmap - sb->journal_block - 1) * BLOCK_SIZE;
+}
+
+uint32_t journal_round_up(uint32_t nbytes) {
+    return (nbytes + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
 
 void read_journal_header(const struct superblock *sb, struct journal_header *jh) {
     read_block_raw(sb->journal_block, jh);
@@ -221,134 +1021,1793 @@ void write_journal_header(const struct superblock *sb, const struct journal_head
     write_block_raw(sb->journal_block, jh);
 }
 
-int append_data_record(const struct superblock *sb, struct journal_header *jh,
-                       uint32_t dest_block, const uint8_t *block_data) {
-    uint32_t record_size = sizeof(struct data_record);
-    uint32_t journal_capacity = BLOCK_SIZE;  // Single block journal as per spec
-    
-    // Check if there's space in journal
-    if (jh->nbytes_used + record_size > journal_capacity) {
-        fprintf(stderr, "Journal full: cannot append data record\n");
-        return -1;
+// Images from older mkfs builds leave the journal zeroed; give them an empty log
+void format_journal_if_blank(const struct superblock *sb) {
+    struct journal_header jh;
+    read_journal_header(sb, &jh);
+    if (jh.magic != 0) return;
+
+    memset(&jh, 0, sizeof(jh));
+    jh.magic = JOURNAL_MAGIC;
+    write_journal_header(sb, &jh);
+}
+
+/*
+ * The superblock state says whether the journal can be trusted to be empty.
+ * mkfs leaves it FS_STATE_CLEAN, and so does a run that exits with its log
+ * emptied by a checkpoint. The first log write of a run clears it, so an
+ * image with committed records, or one a crash interrupted, is replayed at
+ * the next open. While it is clean the log itself is never read.
+ */
+int fs_clean = 0;
+int log_emptied = 0;    // a checkpoint in this run left the log empty
+
+/*
+ * The log as far as recovery has read it. The scan asks for the bytes it is
+ * about to look at, and they are read READ_RUN_BLOCKS at a time going
+ * forward from head, so opening a dirty image reads what its committed
+ * transactions span rather than the whole journal region.
+ */
+struct log_reader {
+    const struct superblock *sb;
+    uint8_t *log;           // journal_capacity bytes, zero where not read
+    uint32_t capacity;
+    uint32_t start;         // head rounded down to a block
+    uint32_t loaded;        // bytes read from start on, wrapping at capacity
+};
+
+// Makes log bytes [pos, pos + len) readable; the range must not wrap
+void log_reader_need(struct log_reader *r, uint32_t pos, uint32_t len) {
+    uint32_t want = (pos + r->capacity - r->start) % r->capacity + len;
+    while (r->loaded < want && r->loaded < r->capacity) {
+        uint32_t at = (r->start + r->loaded) % r->capacity;
+        uint32_t n = READ_RUN_BLOCKS * BLOCK_SIZE;
+        if (n > r->capacity - at) n = r->capacity - at;
+        if (n > r->capacity - r->loaded) n = r->capacity - r->loaded;
+        read_blocks_raw(r->sb->journal_block + 1 + at / BLOCK_SIZE, n / BLOCK_SIZE, r->log + at);
+        r->loaded += n;
     }
-    
-    // Prepare the data record
-    struct data_record rec;
-    rec.hdr.type = REC_DATA;
-    rec.hdr.size = record_size;
-    rec.block_no = dest_block;
-    memcpy(rec.data, block_data, BLOCK_SIZE);
-    
-    // Read current journal block
-    uint8_t journal_buf[BLOCK_SIZE];
-    read_block_raw(sb->journal_block, journal_buf);
-    
-    // Append record at nbytes_used offset
-    memcpy(journal_buf + jh->nbytes_used, &rec, record_size);
-    jh->nbytes_used += record_size;
-    
-    // Update header in buffer
-    memcpy(journal_buf, jh, sizeof(struct journal_header));
-    
-    // Write back
-    write_block_raw(sb->journal_block, journal_buf);
-    
-    return 0;
 }
 
-int append_commit_record(const struct superblock *sb, struct journal_header *jh) {
-    uint32_t record_size = sizeof(struct commit_record);
-    uint32_t journal_capacity = BLOCK_SIZE;
-    
-    if (jh->nbytes_used + record_size > journal_capacity) {
-        fprintf(stderr, "Journal full: cannot append commit record\n");
-        return -1;
+// True if the log continues at offset 0: a REC_WRAP marker, or no room for one
+int journal_wraps_at(const uint8_t *log, uint32_t capacity, uint32_t pos) {
+    if (pos > 0 && capacity - pos < sizeof(struct wrap_record)) return 1;
+    return ((const struct rec_header *)(log + pos))->type == REC_WRAP;
+}
+
+/*
+ * Steps through the live part of the log. On success *rec points at the next
+ * record and pos/remaining move past it. Returns 1 for a record, 0 at the end
+ * of the live region and -1 if the log is malformed.
+ */
+int journal_next_record(const uint8_t *log, uint32_t capacity, uint32_t *pos,
+                        uint32_t *remaining, const struct rec_header **rec) {
+    while (*remaining > 0) {
+        if (*pos + sizeof(struct rec_header) > capacity) return -1;
+        const struct rec_header *hdr = (const struct rec_header *)(log + *pos);
+
+        if (journal_wraps_at(log, capacity, *pos)) {
+            uint32_t skipped = capacity - *pos;
+            if (skipped > *remaining) return -1;
+            *remaining -= skipped;
+            *pos = 0;
+            continue;
+        }
+
+        if (hdr->size < sizeof(struct rec_header) || hdr->size % 4 != 0) return -1;
+        uint32_t span = hdr->size;
+        if (span > *remaining || *pos + span > capacity) return -1;
+
+        *rec = hdr;
+        *pos = (*pos + span) % capacity;
+        *remaining -= span;
+        return 1;
     }
-    
-    struct commit_record rec;
-    rec.hdr.type = REC_COMMIT;
-    rec.hdr.size = record_size;
-    
-    uint8_t journal_buf[BLOCK_SIZE];
-    read_block_raw(sb->journal_block, journal_buf);
-    
-    memcpy(journal_buf + jh->nbytes_used, &rec, record_size);
-    jh->nbytes_used += record_size;
-    
-    memcpy(journal_buf, jh, sizeof(struct journal_header));
-    write_block_raw(sb->journal_block, journal_buf);
-    
     return 0;
 }
 
+/*
+ * Committed transactions stay in the log until install copies them home, so
+ * metadata reads must see the newest journaled image of a block, not just
+ * the (possibly stale) home location.
+ */
+// Applies a DATA or DELTA record to buffer if it targets block_num
+void journal_apply_record(const struct rec_header *hdr, uint32_t block_num, uint8_t *buffer) {
+    if (hdr->type == REC_DATA) {
+        const struct data_record *rec = (const struct data_record *)hdr;
+        if (rec->block_no == block_num) {
+            memcpy(buffer, rec->data, BLOCK_SIZE);
+        }
+    } else if (hdr->type == REC_DELTA) {
+        const struct delta_record *rec = (const struct delta_record *)hdr;
+        if (rec->block_no == block_num) {
+            memcpy(buffer + rec->offset, rec->data, rec->length);
+        }
+    }
+}
+
+// Rejects records whose size or byte range could not have been written by txn_commit
+int journal_record_valid(const struct rec_header *hdr) {
+    if (hdr->type == REC_DATA) {
+        return hdr->size == sizeof(struct data_record);
+    }
+    if (hdr->type == REC_DELTA) {
+        const struct delta_record *rec = (const struct delta_record *)hdr;
+        return hdr->size >= sizeof(struct delta_record) + rec->length &&
+               (uint32_t)rec->offset + rec->length <= BLOCK_SIZE;
+    }
+    return hdr->type == REC_COMMIT && hdr->size == sizeof(struct commit_record);
+}
+
+/*
+ * Walks forward from head over transactions whose commit record carries the
+ * next expected sequence number and a matching checksum, and sets tail,
+ * tail_seq and nbytes_used to the end of the last one. Returns the number of
+ * committed transactions; *torn is set if the walk stopped at a transaction
+ * whose commit record was present but did not verify.
+ */
+int journal_scan(struct log_reader *r, struct journal_header *jh, int *torn) {
+    const uint8_t *log = r->log;
+    uint32_t capacity = r->capacity;
+    uint32_t pos = jh->head;
+    uint32_t used = 0;
+    uint32_t seq = jh->head_seq;
+    int count = 0;
+    *torn = 0;
+
+    while (used < capacity) {
+        uint32_t start = pos;
+        uint32_t skipped = 0;
+        if (capacity - pos >= sizeof(struct wrap_record)) {
+            log_reader_need(r, pos, sizeof(struct wrap_record));
+        }
+        if (journal_wraps_at(log, capacity, pos)) {
+            if (pos == 0) break;
+            if (capacity - pos >= sizeof(struct wrap_record) &&
+                ((const struct wrap_record *)(log + pos))->seq != seq) {
+                break;
+            }
+            skipped = capacity - pos;
+            pos = 0;
+        }
+
+        uint32_t crc = CRC32C_INIT;
+        uint32_t p = pos;
+        uint32_t budget = capacity - used - skipped;
+        int committed = 0;
+        while (capacity - p >= sizeof(struct rec_header)) {
+            log_reader_need(r, p, sizeof(struct rec_header));
+            const struct rec_header *hdr = (const struct rec_header *)(log + p);
+            if (hdr->size < sizeof(struct rec_header) || hdr->size % 4 != 0 ||
+                hdr->size > capacity - p || hdr->size > budget - (p - pos)) {
+                break;
+            }
+            log_reader_need(r, p, hdr->size);
+            if (!journal_record_valid(hdr)) {
+                break;
+            }
+            if (hdr->type == REC_COMMIT) {
+                const struct commit_record *commit = (const struct commit_record *)hdr;
+                if (commit->seq != seq) break;
+                crc = crc32c_update(crc, &commit->seq, sizeof(commit->seq));
+                if (~crc != commit->checksum) {
+                    *torn = 1;
+                    break;
+                }
+                p += hdr->size;
+                committed = 1;
+                break;
+            }
+            crc = crc32c_update(crc, hdr, hdr->size);
+            p += hdr->size;
+        }
+
+        if (!committed) {
+            pos = start;
+            break;
+        }
+        used += skipped + (p - pos);
+        pos = p % capacity;
+        seq++;
+        count++;
+    }
+
+    jh->tail = pos;
+    jh->tail_seq = seq;
+    jh->nbytes_used = used;
+    return count;
+}
+
+/*
+ * Reads the header and recovers the committed part of the log. Returns -1 if
+ * the journal magic is wrong. The caller gets a log area holding what the
+ * scan read, with the rest zeroed as room for new records, and must free it.
+ */
+int open_journal(const struct superblock *sb, struct journal_header *jh, uint8_t **log_out) {
+    read_journal_header(sb, jh);
+    if (jh->magic != JOURNAL_MAGIC) {
+        return -1;
+    }
+    uint8_t *log = calloc(1, journal_capacity(sb));
+    if (!log) {
+        fprintf(stderr, "open_journal: out of memory\n");
+        exit(1);
+    }
+    *log_out = log;
+    if (fs_clean) {
+        // Checkpoint left head == tail; nothing past it can be committed
+        jh->nbytes_used = 0;
+        jh->head = jh->tail;
+        jh->head_seq = jh->tail_seq;
+        return 0;
+    }
+    struct phase_timer timer;
+    phase_begin(&timer, PHASE_REPLAY);
+    struct log_reader r = { sb, log, journal_capacity(sb), jh->head / BLOCK_SIZE * BLOCK_SIZE, 0 };
+    static int torn_reported = 0;
+    int torn;
+    journal_scan(&r, jh, &torn);
+    if (torn && !torn_reported) {
+        fprintf(stderr, "  Discarding torn transaction %u at log offset %u\n", jh->tail_seq, jh->tail);
+        torn_reported = 1;
+    }
+    phase_end(&timer);
+    return 0;
+}
+
+/* ===================== Journal Overlay ===================== */
+
+/*
+ * Reads see committed transactions through an index from block number to
+ * the records that touch it. The index is built from the log once per run
+ * and extended by every commit, so a read costs one home read plus its own
+ * records instead of a scan of the whole log. A full-block record replaces
+ * everything logged before it, so an entry keeps only the records from its
+ * last full image on, plus the image they produce once it has been read.
+ *
+ * The in-memory log is also the write buffer for group commit: a commit
+ * appends its records here and a leader writes everything past the durable
+ * tail in one go (see journal_write_pending). journal_mutex guards the
+ * overlay, the log state and the group commit state.
+ */
+struct overlay_entry {
+    uint32_t block_no;
+    uint32_t used;          // slot in use
+    uint32_t nrecs;
+    uint32_t cap;
+    uint32_t *recs;         // log offsets of the records, oldest first
+    uint8_t *image;         // home block with recs applied, NULL until read
+};
+
+struct journal_overlay {
+    int loaded;
+    int valid;                  // journal magic was good
+    struct journal_header jh;   // log state after the last commit
+    uint8_t *log;               // log area: what recovery read, then new records
+    uint32_t log_capacity;
+    uint32_t capacity;          // hash table slots, a power of two
+    uint32_t nentries;
+    struct overlay_entry *table;
+};
+
+struct journal_overlay overlay;
+
+struct group_commit {
+    int flushing;               // a leader is writing the log
+    int ordered;                // queued transactions wrote file data in place
+    uint32_t durable_tail;      // log bytes before this offset are on disk
+    uint32_t durable_seq;       // transactions before this one are on disk
+    uint32_t *commits;          // scratch: commit record offsets in a group
+    uint32_t commits_cap;
+    uint8_t *out;               // scratch: log blocks being written
+    uint64_t writes;            // leader writes so far
+};
+
+struct group_commit group;
+pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_durable = PTHREAD_COND_INITIALIZER;
+
+struct overlay_entry *overlay_slot(uint32_t block_num, int create) {
+    if (create && (overlay.nentries + 1) * 10 > overlay.capacity * 7) {
+        uint32_t capacity = overlay.capacity ? overlay.capacity * 2 : 256;
+        struct overlay_entry *table = calloc(capacity, sizeof(struct overlay_entry));
+        if (!table) {
+            fprintf(stderr, "overlay_slot: out of memory\n");
+            exit(1);
+        }
+        for (uint32_t i = 0; i < overlay.capacity; i++) {
+            if (!overlay.table[i].used) continue;
+            uint32_t j = (overlay.table[i].block_no * 2654435761U) & (capacity - 1);
+            while (table[j].used) j = (j + 1) & (capacity - 1);
+            table[j] = overlay.table[i];
+        }
+        free(overlay.table);
+        overlay.table = table;
+        overlay.capacity = capacity;
+    }
+    if (overlay.capacity == 0) return NULL;
+
+    uint32_t j = (block_num * 2654435761U) & (overlay.capacity - 1);
+    while (overlay.table[j].used) {
+        if (overlay.table[j].block_no == block_num) return &overlay.table[j];
+        j = (j + 1) & (overlay.capacity - 1);
+    }
+    if (!create) return NULL;
+    overlay.table[j].used = 1;
+    overlay.table[j].block_no = block_num;
+    overlay.nentries++;
+    return &overlay.table[j];
+}
+
+// Adds the DATA and DELTA records in log bytes [pos, pos + nbytes) to the index
+void overlay_index(uint32_t pos, uint32_t nbytes) {
+    const struct rec_header *hdr;
+    while (journal_next_record(overlay.log, overlay.log_capacity, &pos, &nbytes, &hdr) > 0) {
+        uint32_t block_num;
+        if (hdr->type == REC_DATA) {
+            block_num = ((const struct data_record *)hdr)->block_no;
+        } else if (hdr->type == REC_DELTA) {
+            block_num = ((const struct delta_record *)hdr)->block_no;
+        } else {
+            continue;
+        }
+
+        struct overlay_entry *e = overlay_slot(block_num, 1);
+        if (hdr->type == REC_DATA) e->nrecs = 0;
+        if (e->nrecs == e->cap) {
+            e->cap = e->cap ? e->cap * 2 : 4;
+            e->recs = realloc(e->recs, e->cap * sizeof(uint32_t));
+            if (!e->recs) {
+                fprintf(stderr, "overlay_index: out of memory\n");
+                exit(1);
+            }
+        }
+        e->recs[e->nrecs++] = (uint32_t)((const uint8_t *)hdr - overlay.log);
+        if (e->image) journal_apply_record(hdr, block_num, e->image);
+    }
+}
+
+void overlay_reset(void) {
+    for (uint32_t i = 0; i < overlay.capacity; i++) {
+        free(overlay.table[i].recs);
+        free(overlay.table[i].image);
+    }
+    free(overlay.table);
+    free(overlay.log);
+    memset(&overlay, 0, sizeof(overlay));
+}
+
+// Recovers the log and indexes it on first use; returns -1 if the journal magic is wrong
+int overlay_load(const struct superblock *sb) {
+    if (overlay.loaded) return overlay.valid ? 0 : -1;
+    overlay.loaded = 1;
+    if (open_journal(sb, &overlay.jh, &overlay.log) < 0) return -1;
+    overlay.valid = 1;
+    overlay.log_capacity = journal_capacity(sb);
+    overlay_index(overlay.jh.head, overlay.jh.nbytes_used);
+    group.durable_tail = overlay.jh.tail;
+    group.durable_seq = overlay.jh.tail_seq;
+    return 0;
+}
+
+// Copies a just-written transaction into the in-memory log and indexes it
+void overlay_append(const struct iovec *iov, int iovcnt, uint32_t pos) {
+    uint32_t nbytes = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(overlay.log + pos + nbytes, iov[i].iov_base, iov[i].iov_len);
+        nbytes += iov[i].iov_len;
+    }
+    overlay_index(pos, nbytes);
+}
+
+// True if e's image is built on its home copy, not on a full image in the log
+int overlay_needs_home(const struct overlay_entry *e) {
+    return ((const struct rec_header *)(overlay.log + e->recs[0]))->type != REC_DATA;
+}
+
+// Gives e an image buffer; the caller fills in the home copy if it needs one
+uint8_t *overlay_image_alloc(struct overlay_entry *e) {
+    e->image = malloc(BLOCK_SIZE);
+    if (!e->image) {
+        fprintf(stderr, "overlay_image: out of memory\n");
+        exit(1);
+    }
+    return e->image;
+}
+
+void overlay_image_apply(struct overlay_entry *e) {
+    for (uint32_t i = 0; i < e->nrecs; i++) {
+        journal_apply_record((const struct rec_header *)(overlay.log + e->recs[i]), e->block_no, e->image);
+    }
+}
+
+// The block's image as of the last commit, built on first use
+const uint8_t *overlay_image(struct overlay_entry *e) {
+    if (e->image) return e->image;
+    overlay_image_alloc(e);
+    if (overlay_needs_home(e)) read_block_raw(e->block_no, e->image);
+    overlay_image_apply(e);
+    return e->image;
+}
+
+// Builds the missing images of n entries, reading their home copies as one batch
+void overlay_images_load(struct overlay_entry **entries, uint32_t n) {
+    struct overlay_entry **built = malloc((n + 1) * sizeof(*built));
+    if (!built) {
+        fprintf(stderr, "overlay_images_load: out of memory\n");
+        exit(1);
+    }
+    uint32_t nbuilt = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (entries[i]->image) continue;
+        overlay_image_alloc(entries[i]);
+        if (overlay_needs_home(entries[i])) read_block_queue(entries[i]->block_no, entries[i]->image);
+        built[nbuilt++] = entries[i];
+    }
+    io_submit_wait();
+    for (uint32_t i = 0; i < nbuilt; i++) {
+        overlay_image_apply(built[i]);
+    }
+    free(built);
+}
+
+// The state word is written in place, never journaled; a journaled image of
+// block 0 built before the change must not put the old state back
+void write_superblock_state(uint32_t state) {
+    uint8_t buf[BLOCK_SIZE];
+    read_block_raw(0, buf);
+    ((struct superblock *)buf)->state = state;
+    write_block_raw(0, buf);
+    struct overlay_entry *e = overlay_slot(0, 0);
+    if (e && e->image) ((struct superblock *)e->image)->state = state;
+    fs_clean = state == FS_STATE_CLEAN;
+}
+
+// Reads a block as of the last commit: the home copy with its journaled records applied
+void read_fs_block(const struct superblock *sb, uint32_t block_num, void *buffer) {
+    pthread_mutex_lock(&journal_mutex);
+    struct overlay_entry *e = NULL;
+    if (overlay_load(sb) == 0) e = overlay_slot(block_num, 0);
+    if (!e || e->nrecs == 0) {
+        read_block_raw(block_num, buffer);
+    } else {
+        memcpy(buffer, overlay_image(e), BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+void read_bitmap_block(const struct superblock *sb, uint32_t bitmap_block_no, uint8_t *bitmap_out) {
+    read_fs_block(sb, bitmap_block_no, bitmap_out);
+}
+
+
+void write_bitmap_block(uint32_t bitmap_block_no, const uint8_t *bitmap_in) {
+    write_block_raw(bitmap_block_no, bitmap_in);
+}
+
+
+int check_bit(const uint8_t *bitmap, int index) {
+    int byte_idx = index / 8;
+    int bit_idx = index % 8;
+    return (bitmap[byte_idx] & (1 << bit_idx)) != 0;
+}
+
+void set_bit(uint8_t *bitmap, int index) {
+    int byte_idx = index / 8;
+    int bit_idx = index % 8;
+    bitmap[byte_idx] |= (1 << bit_idx);
+}
+
+void clear_bit(uint8_t *bitmap, int index) {
+    int byte_idx = index / 8;
+    int bit_idx = index % 8;
+    bitmap[byte_idx] &= ~(1 << bit_idx);
+}
+
+
+/*
+ * Word-at-a-time bitmap scans. Bitmaps are little-endian byte arrays, so
+ * bit i of a loaded 64-bit word is bitmap bit (word * 64 + i) on x86 and
+ * any other little-endian host.
+ */
+static uint64_t bitmap_word(const uint8_t *bitmap, uint32_t word) {
+    uint64_t w;
+    memcpy(&w, bitmap + word * 8, sizeof(w));
+    return w;
+}
+
+// First bit in [from, to) equal to value, or -1
+int bitmap_find(const uint8_t *bitmap, uint32_t from, uint32_t to, int value) {
+    uint64_t flip = value ? 0 : ~0ULL;
+    while (from < to) {
+        uint64_t w = (bitmap_word(bitmap, from / 64) ^ flip) >> (from % 64);
+        if (w != 0) {
+            uint32_t bit = from + (uint32_t)__builtin_ctzll(w);
+            return bit < to ? (int)bit : -1;
+        }
+        from += 64 - from % 64;
+    }
+    return -1;
+}
+
+// First run of n clear bits inside [from, to), or -1
+int bitmap_find_run(const uint8_t *bitmap, uint32_t from, uint32_t to, uint32_t n) {
+    while (from + n <= to) {
+        int start = bitmap_find(bitmap, from, to - n + 1, 0);
+        if (start < 0) return -1;
+        int used = bitmap_find(bitmap, (uint32_t)start, (uint32_t)start + n, 1);
+        if (used < 0) return start;
+        from = (uint32_t)used + 1;
+    }
+    return -1;
+}
+
+// Number of set bits among the first nbits
+uint32_t bitmap_count(const uint8_t *bitmap, uint32_t nbits) {
+    uint32_t count = 0;
+    for (uint32_t word = 0; word < nbits / 64; word++) {
+        count += (uint32_t)__builtin_popcountll(bitmap_word(bitmap, word));
+    }
+    if (nbits % 64) {
+        uint64_t mask = (1ULL << (nbits % 64)) - 1;
+        count += (uint32_t)__builtin_popcountll(bitmap_word(bitmap, nbits / 64) & mask);
+    }
+    return count;
+}
+
+
+/* ===================== PHASE 2: FS Reader Functions ===================== */
+
+/*
+ * Committed inodes, so a lookup copies 128 bytes instead of pulling a whole
+ * inode block through the overlay. A miss caches every inode of its block.
+ * Commit refreshes the inodes a transaction changed, under journal_mutex
+ * once its records are queued; a miss that raced with a refresh is not
+ * cached. Direct-mapped by inode number, so a block's inodes never evict
+ * each other.
+ */
+#define ICACHE_INODES 4096
+
+struct inode_cache {
+    pthread_mutex_t lock;
+    uint64_t gen;                           // bumped by every commit refresh
+    uint32_t inum_plus1[ICACHE_INODES];     // 0 = empty slot
+    struct inode inodes[ICACHE_INODES];
+    uint64_t hits;
+    uint64_t misses;
+};
+
+struct inode_cache icache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void read_inode(const struct superblock *sb, uint32_t inum, struct inode *inode_out) {
+    uint32_t slot = inum % ICACHE_INODES;
+    pthread_mutex_lock(&icache.lock);
+    if (icache.inum_plus1[slot] == inum + 1) {
+        *inode_out = icache.inodes[slot];
+        icache.hits++;
+        pthread_mutex_unlock(&icache.lock);
+        return;
+    }
+    icache.misses++;
+    uint64_t gen = icache.gen;
+    pthread_mutex_unlock(&icache.lock);
+    
+    uint8_t block_buf[BLOCK_SIZE];
+    read_fs_block(sb, sb->inode_start + inum / INODES_PER_BLOCK, block_buf);
+    const struct inode *inodes = (const struct inode *)block_buf;
+    *inode_out = inodes[inum % INODES_PER_BLOCK];
+    
+    uint32_t first = inum - inum % INODES_PER_BLOCK;
+    pthread_mutex_lock(&icache.lock);
+    for (uint32_t k = 0; icache.gen == gen && k < INODES_PER_BLOCK && first + k < sb->inode_count; k++) {
+        icache.inum_plus1[(first + k) % ICACHE_INODES] = first + k + 1;
+        icache.inodes[(first + k) % ICACHE_INODES] = inodes[k];
+    }
+    pthread_mutex_unlock(&icache.lock);
+}
+
+// A slot is free only if it has neither an inode nor a name: "." and ".." in
+// the root directory legitimately point at inode 0
+int dirent_in_use(const struct dirent *de) {
+    return de->inode != 0 || de->name[0] != '\0';
+}
+
+
+/* ===================== PHASE 3: Journal Functions ===================== */
+
+/*
+ * Reserves room for a transaction of nbytes at the tail of the log, wrapping
+ * to offset 0 when it would run past the end. Only the in-memory header and
+ * log are updated; the wrap marker goes out with the next group write, and
+ * the transaction becomes visible once its commit record is durable.
+ */
+int journal_reserve(const struct superblock *sb, struct journal_header *jh, uint32_t nbytes) {
+    uint32_t capacity = journal_capacity(sb);
+    uint32_t needed = nbytes;
+
+    uint32_t used = jh->nbytes_used;
+    uint32_t tail = jh->tail;
+    if (tail + needed > capacity) {
+        used += capacity - tail;
+        tail = 0;
+    }
+    if (used + needed > capacity) {
+        return -1;
+    }
+
+    if (tail != jh->tail && capacity - jh->tail >= sizeof(struct wrap_record)) {
+        struct wrap_record *wrap = (struct wrap_record *)(overlay.log + jh->tail);
+        wrap->hdr.type = REC_WRAP;
+        wrap->hdr.size = sizeof(struct wrap_record);
+        wrap->seq = jh->tail_seq;
+    }
+    jh->tail = tail;
+    jh->nbytes_used = used;
+    return 0;
+}
+
+
+/*
+ * A transaction collects the final image of every block it dirties. Each
+ * block is logged once no matter how often it is modified, and the records
+ * are only assembled when the transaction commits. The image a block had
+ * when it joined the transaction is kept so that commit can log only the
+ * bytes that changed.
+ *
+ * File data is not logged (ordered mode). txn_write_data writes it straight
+ * to its home blocks, and commit makes that data durable before it writes
+ * the records, so a committed transaction never maps blocks whose contents
+ * did not reach the disk. This only holds for blocks the transaction itself
+ * allocated: nothing committed may still point at them.
+ *
+ * Many threads can build transactions at once. Blocks are not locked; a
+ * transaction instead holds the locks of the objects it changes (the root
+ * directory, an allocator, a file's inode) from first use until its records
+ * are queued, always taking them in that order. Two transactions may then
+ * share a block only to change different bytes of it, and commit folds in
+ * whatever other transactions queued for the block since it was read.
+ */
+#define TXN_MAX_BLOCKS 14
+#define TXN_MAX_LOCKS 4
+#define JOURNAL_HIGH_WATER_PCT 75     // checkpoint once the log is fuller than this
+#define TXN_MAX_EXTENTS 16     // more changed ranges than this logs the full block
+
+struct transaction {
+    uint32_t nblocks;
+    uint32_t nheld;
+    pthread_mutex_t *held[TXN_MAX_LOCKS];   // released once the records are queued
+    uint64_t ordered_blocks;    // data blocks written in place, flushed before commit
+    uint32_t taken[2];          // inodes and data blocks allocated, see txn_apply_counts
+    uint32_t hint[2];           // allocator hints before the first take, see txn_undo
+    int dir_changed;            // added to the root directory index, see txn_undo
+    int queued;                 // records queued by commit, nothing left to undo
+    uint32_t block_no[TXN_MAX_BLOCKS];
+    uint32_t inode_dirty[TXN_MAX_BLOCKS];   // inodes handed out by txn_get_inode, a bit each
+    uint8_t  base[TXN_MAX_BLOCKS][BLOCK_SIZE];
+    uint8_t  data[TXN_MAX_BLOCKS][BLOCK_SIZE];
+};
+
+struct txn_extent {
+    uint16_t offset;
+    uint16_t length;
+};
+
+void txn_begin(struct transaction *txn) {
+    txn->nblocks = 0;
+    txn->nheld = 0;
+    txn->ordered_blocks = 0;
+    txn->taken[0] = txn->taken[1] = 0;
+    txn->dir_changed = 0;
+    txn->queued = 0;
+}
+
+// Takes lock for the rest of the transaction unless it already holds it
+void txn_hold(struct transaction *txn, pthread_mutex_t *lock) {
+    for (uint32_t i = 0; i < txn->nheld; i++) {
+        if (txn->held[i] == lock) return;
+    }
+    if (txn->nheld == TXN_MAX_LOCKS) {
+        fprintf(stderr, "txn_hold: transaction holds too many locks\n");
+        exit(1);
+    }
+    pthread_mutex_lock(lock);
+    txn->held[txn->nheld++] = lock;
+}
+
+void txn_undo(struct transaction *txn);
+
+// Drops the transaction's locks; commit does this, failed callers must too.
+// A transaction that never got queued first undoes its in-memory changes
+void txn_release(struct transaction *txn) {
+    if (!txn->queued) txn_undo(txn);
+    while (txn->nheld > 0) {
+        pthread_mutex_unlock(txn->held[--txn->nheld]);
+    }
+}
+
+// Writes nblocks of file data home, ahead of the transaction that maps them
+void txn_write_data(struct transaction *txn, uint32_t block_num, const void *data, uint32_t nblocks) {
+    struct iovec iov = { (void *)data, (size_t)nblocks * BLOCK_SIZE };
+    write_blocks_raw(block_num, &iov, 1);
+    txn->ordered_blocks += nblocks;
+}
+
+// Returns the transaction's copy of block_num, or NULL if it has none
+uint8_t *txn_find_block(struct transaction *txn, uint32_t block_num) {
+    for (uint32_t i = 0; i < txn->nblocks; i++) {
+        if (txn->block_no[i] == block_num) {
+            return txn->data[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns the transaction's copy of block_num, reading it in on first use
+uint8_t *txn_get_block(const struct superblock *sb, struct transaction *txn, uint32_t block_num) {
+    uint8_t *data = txn_find_block(txn, block_num);
+    if (data) {
+        return data;
+    }
+    if (txn->nblocks == TXN_MAX_BLOCKS) {
+        fprintf(stderr, "Error: Transaction touches more than %d blocks\n", TXN_MAX_BLOCKS);
+        return NULL;
+    }
+    uint32_t i = txn->nblocks++;
+    txn->block_no[i] = block_num;
+    txn->inode_dirty[i] = 0;
+    read_fs_block(sb, block_num, txn->base[i]);
+    memcpy(txn->data[i], txn->base[i], BLOCK_SIZE);
+    return txn->data[i];
+}
+
+/*
+ * The transaction's copy of inode inum. Inode blocks are logged from the
+ * inodes handed out here rather than by diffing the whole block, so every
+ * change to an inode must go through this.
+ */
+struct inode *txn_get_inode(const struct superblock *sb, struct transaction *txn, uint32_t inum) {
+    uint8_t *block = txn_get_block(sb, txn, sb->inode_start + inum / INODES_PER_BLOCK);
+    if (!block) return NULL;
+    uint32_t i = (uint32_t)((block - txn->data[0]) / BLOCK_SIZE);
+    txn->inode_dirty[i] |= 1U << (inum % INODES_PER_BLOCK);
+    return (struct inode *)block + inum % INODES_PER_BLOCK;
+}
+
+uint32_t delta_record_size(uint32_t length) {
+    return (sizeof(struct delta_record) + length + 3) & ~3U;
+}
+
+/*
+ * Finds the byte ranges in [from, to) where data differs from base and adds
+ * them to the n extents already in ext. Ranges separated by fewer bytes than
+ * a record header are merged, since a second record would cost more than
+ * re-logging the unchanged gap. Returns the new number of extents or -1 if
+ * there are more than max.
+ */
+int diff_range(const uint8_t *base, const uint8_t *data, uint32_t from, uint32_t to,
+               struct txn_extent *ext, int n, int max) {
+    uint32_t i = from;
+    while (i < to) {
+        // Skip identical 8-byte words quickly before narrowing to bytes
+        if (i % 8 == 0 && i + 8 <= to && memcmp(base + i, data + i, 8) == 0) {
+            i += 8;
+            continue;
+        }
+        if (base[i] == data[i]) {
+            i++;
+            continue;
+        }
+        uint32_t start = i;
+        uint32_t end = i + 1;
+        for (uint32_t j = end; j < to && j < end + sizeof(struct delta_record); j++) {
+            if (base[j] != data[j]) end = j + 1;
+        }
+        while (end < to) {
+            uint32_t j = end;
+            while (j < to && j < end + sizeof(struct delta_record) && base[j] == data[j]) j++;
+            if (j >= to || j == end + sizeof(struct delta_record)) break;
+            end = j + 1;
+        }
+        if (n == max) return -1;
+        ext[n].offset = (uint16_t)start;
+        ext[n].length = (uint16_t)(end - start);
+        n++;
+        i = end;
+    }
+    return n;
+}
+
+int diff_block(const uint8_t *base, const uint8_t *data, struct txn_extent *ext, int max) {
+    return diff_range(base, data, 0, BLOCK_SIZE, ext, 0, max);
+}
+
+uint32_t extents_log_bytes(const struct txn_extent *ext, int n) {
+    uint32_t bytes = 0;
+    for (int e = 0; e < n; e++) {
+        bytes += delta_record_size(ext[e].length);
+    }
+    return bytes;
+}
+
+int inode_changed(const uint8_t *base, const uint8_t *data, uint32_t dirty, uint32_t k) {
+    uint32_t off = k * sizeof(struct inode);
+    return (dirty & (1U << k)) && memcmp(base + off, data + off, sizeof(struct inode)) != 0;
+}
+
+/*
+ * Extents for an inode block, comparing only the inodes in the dirty mask.
+ * Each run of neighbouring changed inodes is logged either as one range
+ * from its first to its last changed byte, or split the way diff_range
+ * would split it, whichever costs fewer log bytes. A batch of inodes
+ * created in a row then goes into one record instead of two per inode.
+ */
+int diff_inodes(const uint8_t *base, const uint8_t *data, uint32_t dirty, struct txn_extent *ext, int max) {
+    struct txn_extent split[TXN_MAX_EXTENTS];
+    int n = 0;
+    int nsplit = 0;
+    uint32_t k = 0;
+    while (k < INODES_PER_BLOCK) {
+        if (!inode_changed(base, data, dirty, k)) {
+            k++;
+            continue;
+        }
+        uint32_t from = k * sizeof(struct inode);
+        while (k < INODES_PER_BLOCK && inode_changed(base, data, dirty, k)) k++;
+        uint32_t to = k * sizeof(struct inode);
+        while (base[from] == data[from]) from++;
+        while (base[to - 1] == data[to - 1]) to--;
+        // Splitting never gives fewer extents, so this bounds both
+        if (n == max) return -1;
+        ext[n].offset = (uint16_t)from;
+        ext[n].length = (uint16_t)(to - from);
+        n++;
+        if (nsplit >= 0) nsplit = diff_range(base, data, from, to, split, nsplit, max);
+    }
+    if (nsplit >= 0 && extents_log_bytes(split, nsplit) < extents_log_bytes(ext, n)) {
+        memcpy(ext, split, (size_t)nsplit * sizeof(*ext));
+        n = nsplit;
+    }
+    return n;
+}
+
+int journal_checkpoint_locked(const struct superblock *sb, FILE *out);
+
+/*
+ * Group commit. Committing threads queue their records in the in-memory log
+ * and wait for them to become durable. Whoever finds no write in progress
+ * becomes the leader. It writes every block between the durable tail and
+ * the current tail with one request per log segment, then flushes once, so
+ * a whole group of transactions shares one write and one flush, and with
+ * io_uring one submission. Threads
+ * that queue while a write is running wait for the next leader. Only the
+ * copy of the blocks is taken under journal_mutex; queueing continues
+ * during the I/O.
+ *
+ * The blocks are copied whole, so the bytes around the new records go back
+ * to disk unchanged. That includes the start of the oldest transaction when
+ * the log has wrapped round to just behind head. With --sync=full, the
+ * group goes out first with its commit records zeroed and is flushed; only
+ * then are the commit records written.
+ */
+void journal_write_pending(const struct superblock *sb) {
+    uint32_t capacity = journal_capacity(sb);
+    struct journal_header target = overlay.jh;
+    uint32_t from = group.durable_tail;
+    uint32_t pending = (target.tail + capacity - from) % capacity;
+    if (pending == 0) pending = capacity;   // tail came all the way round
+    int ordered = group.ordered;
+    group.ordered = 0;
+    group.flushing = 1;
+
+    if (!group.out) {
+        group.out = malloc(capacity);
+        if (!group.out) {
+            fprintf(stderr, "journal_write_pending: out of memory\n");
+            exit(1);
+        }
+        struct iovec fixed = { group.out, capacity };
+        pthread_mutex_lock(&uring_lock);
+        uring_register(&disk_ring, &fixed, 1);
+        pthread_mutex_unlock(&uring_lock);
+    }
+
+    // One segment, or two when the group wrapped to the start of the log
+    uint32_t end = from + pending;
+    uint32_t seg_from[2] = { from / BLOCK_SIZE * BLOCK_SIZE, 0 };
+    uint32_t seg_to[2] = { journal_round_up(end), 0 };
+    int nseg = 1;
+    if (end > capacity) {
+        seg_to[0] = capacity;
+        seg_to[1] = journal_round_up(end - capacity);
+        nseg = 2;
+    }
+    for (int i = 0; i < nseg; i++) {
+        memcpy(group.out + seg_from[i], overlay.log + seg_from[i], seg_to[i] - seg_from[i]);
+    }
+
+    uint32_t ncommits = 0;
+    if (sync_mode == SYNC_FULL) {
+        uint32_t pos = from;
+        uint32_t remaining = pending;
+        const struct rec_header *hdr;
+        while (journal_next_record(overlay.log, capacity, &pos, &remaining, &hdr) > 0) {
+            if (hdr->type != REC_COMMIT) continue;
+            if (ncommits == group.commits_cap) {
+                group.commits_cap = group.commits_cap ? group.commits_cap * 2 : 64;
+                group.commits = realloc(group.commits, group.commits_cap * sizeof(uint32_t));
+                if (!group.commits) {
+                    fprintf(stderr, "journal_write_pending: out of memory\n");
+                    exit(1);
+                }
+            }
+            uint32_t off = (uint32_t)((const uint8_t *)hdr - overlay.log);
+            group.commits[ncommits++] = off;
+            memset(group.out + off, 0, sizeof(struct commit_record));
+        }
+    }
+    // The first log write of a run marks the image dirty, and the mark
+    // must be durable before any commit record can be
+    if (fs_clean) {
+        write_superblock_state(0);
+        ordered = 1;
+    }
+    pthread_mutex_unlock(&journal_mutex);
+
+    // Ordered mode: data the transactions map must be durable before any
+    // commit record can be. The flush is a barrier ahead of the log writes
+    // in the same batch
+    if (ordered) {
+        bcache_flush();
+        if (sync_mode != SYNC_NONE) io_queue_flush();
+    }
+    struct iovec seg_iov[2];
+    for (int pass = 0; pass < (ncommits > 0 ? 2 : 1); pass++) {
+        if (pass == 1) {
+            sync_disk();
+            // Queued records are never changed, so the log can be read unlocked
+            for (uint32_t i = 0; i < ncommits; i++) {
+                memcpy(group.out + group.commits[i], overlay.log + group.commits[i], sizeof(struct commit_record));
+            }
+        }
+        for (int i = 0; i < nseg; i++) {
+            seg_iov[i].iov_base = group.out + seg_from[i];
+            seg_iov[i].iov_len = seg_to[i] - seg_from[i];
+            write_blocks_queue(sb->journal_block + 1 + seg_from[i] / BLOCK_SIZE, &seg_iov[i], 1);
+        }
+    }
+    sync_disk();
+
+    pthread_mutex_lock(&journal_mutex);
+    group.durable_tail = target.tail;
+    group.durable_seq = target.tail_seq;
+    group.flushing = 0;
+    group.writes++;
+    pthread_cond_broadcast(&journal_durable);
+}
+
+// Returns once transaction seq is durable, leading a group write if needed
+void journal_wait_durable(const struct superblock *sb, uint32_t seq) {
+    while ((int32_t)(seq - group.durable_seq) >= 0) {
+        if (group.flushing) {
+            pthread_cond_wait(&journal_durable, &journal_mutex);
+        } else {
+            journal_write_pending(sb);
+        }
+    }
+}
+
+/*
+ * Folds into block i whatever other transactions queued for it after txn
+ * read it in. The locking rules leave the two sides changing different
+ * bytes, so the new image is the current one with txn's own changes XORed
+ * in. The current image becomes the new base, so commit logs only txn's
+ * changes.
+ */
+void txn_merge_block(struct transaction *txn, uint32_t i) {
+    uint8_t current[BLOCK_SIZE];
+    struct overlay_entry *e = overlay_slot(txn->block_no[i], 0);
+    if (e && e->nrecs > 0) {
+        memcpy(current, overlay_image(e), BLOCK_SIZE);
+    } else {
+        read_block_raw(txn->block_no[i], current);
+    }
+    if (memcmp(current, txn->base[i], BLOCK_SIZE) == 0) return;
+
+    for (uint32_t w = 0; w < BLOCK_SIZE / sizeof(uint64_t); w++) {
+        uint64_t cur, base, data;
+        memcpy(&cur, current + w * sizeof(uint64_t), sizeof(uint64_t));
+        memcpy(&base, txn->base[i] + w * sizeof(uint64_t), sizeof(uint64_t));
+        memcpy(&data, txn->data[i] + w * sizeof(uint64_t), sizeof(uint64_t));
+        data = cur ^ (data ^ base);
+        memcpy(txn->data[i] + w * sizeof(uint64_t), &data, sizeof(uint64_t));
+    }
+    memcpy(txn->base[i], current, BLOCK_SIZE);
+}
+
+/*
+ * The superblock free counters are charged at commit rather than as the
+ * allocations happen: a transaction may read block 0 before it holds the
+ * allocator lock that guards a counter, and a stale counter would not merge.
+ * After the merge the base is what is queued ahead, so the counters become
+ * that minus this transaction's allocations; a second plan gives the same.
+ * On an image from before the counters the base has none to charge, and
+ * the transaction that turns them on sets them outright.
+ */
+void txn_apply_counts(struct transaction *txn, uint32_t i) {
+    const struct superblock *base = (const struct superblock *)txn->base[i];
+    struct superblock *data = (struct superblock *)txn->data[i];
+    if (!(base->features & FS_FEATURE_FREE_COUNTS)) return;
+    data->free_inodes = base->free_inodes - txn->taken[0];
+    data->free_blocks = base->free_blocks - txn->taken[1];
+}
+
+/*
+ * Merges each block with what is queued for it and chooses its records:
+ * nextents[i] delta ranges, -1 for a full image, 0 if it did not change.
+ * Returns the bytes the transaction needs in the log.
+ */
+uint32_t txn_plan_records(struct transaction *txn, struct txn_extent extents[][TXN_MAX_EXTENTS],
+                          int *nextents, uint32_t *logged_blocks) {
+    uint32_t txn_bytes = sizeof(struct commit_record);
+    *logged_blocks = 0;
+    for (uint32_t i = 0; i < txn->nblocks; i++) {
+        txn_merge_block(txn, i);
+        if (txn->block_no[i] == 0) txn_apply_counts(txn, i);
+        if (txn->inode_dirty[i]) {
+            nextents[i] = diff_inodes(txn->base[i], txn->data[i], txn->inode_dirty[i], extents[i], TXN_MAX_EXTENTS);
+        } else {
+            nextents[i] = diff_block(txn->base[i], txn->data[i], extents[i], TXN_MAX_EXTENTS);
+        }
+        if (nextents[i] == 0) continue;
+
+        uint32_t delta_bytes = extents_log_bytes(extents[i], nextents[i]);
+        if (nextents[i] < 0 || delta_bytes >= sizeof(struct data_record)) {
+            nextents[i] = -1;   // full image is no bigger, log it whole
+            delta_bytes = sizeof(struct data_record);
+        }
+        txn_bytes += delta_bytes;
+        (*logged_blocks)++;
+    }
+    return txn_bytes;
+}
+
+// Gives the inode cache the committed image of every inode txn handed out
+void icache_refresh(const struct superblock *sb, const struct transaction *txn) {
+    pthread_mutex_lock(&icache.lock);
+    icache.gen++;
+    for (uint32_t i = 0; i < txn->nblocks; i++) {
+        uint32_t first = (txn->block_no[i] - sb->inode_start) * INODES_PER_BLOCK;
+        for (uint32_t k = 0; k < INODES_PER_BLOCK; k++) {
+            if (!(txn->inode_dirty[i] & (1U << k))) continue;
+            uint32_t slot = (first + k) % ICACHE_INODES;
+            if (icache.inum_plus1[slot] != first + k + 1) continue;
+            icache.inodes[slot] = ((const struct inode *)txn->data[i])[k];
+        }
+    }
+    pthread_mutex_unlock(&icache.lock);
+}
+
+struct commit_latency {
+    uint32_t commits;
+    double total_ms;
+    double max_ms;
+} commit_latency;
+
+double elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - since->tv_sec) * 1e3 + (double)(now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+/*
+ * Queues every record plus the commit record at the log tail, where the
+ * read overlay sees them at once, drops the transaction's locks and waits
+ * for a group write to make them durable. The header on disk is only
+ * rewritten by a checkpoint; until then recovery finds the tail by
+ * scanning. Each block is logged as delta records when that is smaller than
+ * its full image, and blocks that did not change are left out altogether.
+ */
+int txn_commit(const struct superblock *sb, struct transaction *txn) {
+    // Per thread: a checkpoint for a full log drops journal_mutex mid-commit
+    static __thread struct txn_extent extents[TXN_MAX_BLOCKS][TXN_MAX_EXTENTS];
+    int nextents[TXN_MAX_BLOCKS];
+    uint32_t logged_blocks;
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    struct phase_timer timer;
+    phase_begin(&timer, PHASE_JOURNAL_APPEND);
+
+    pthread_mutex_lock(&journal_mutex);
+    if (overlay_load(sb) < 0) {
+        pthread_mutex_unlock(&journal_mutex);
+        txn_release(txn);
+        fprintf(stderr, "Error: Invalid journal magic\n");
+        return -1;
+    }
+
+    uint32_t txn_bytes = txn_plan_records(txn, extents, nextents, &logged_blocks);
+    if (logged_blocks == 0) {
+        pthread_mutex_unlock(&journal_mutex);
+        txn->queued = 1;
+        txn_release(txn);
+        return 0;
+    }
+
+    struct journal_header jh = overlay.jh;
+    if (journal_reserve(sb, &jh, txn_bytes) < 0) {
+        // Out of log space: checkpoint what is already committed, then retry
+        printf("  Journal full, checkpointing first...\n");
+        if (journal_checkpoint_locked(sb, stdout) < 0) {
+            pthread_mutex_unlock(&journal_mutex);
+            txn_release(txn);
+            return -1;
+        }
+        // Others may have queued changes to these blocks meanwhile
+        overlay_load(sb);
+        txn_bytes = txn_plan_records(txn, extents, nextents, &logged_blocks);
+        jh = overlay.jh;
+        if (journal_reserve(sb, &jh, txn_bytes) < 0) {
+            pthread_mutex_unlock(&journal_mutex);
+            txn_release(txn);
+            fprintf(stderr, "Error: Transaction does not fit in the journal\n");
+            return -1;
+        }
+    }
+
+    struct {
+        struct rec_header hdr;
+        uint32_t block_no;
+    } rec_heads[TXN_MAX_BLOCKS];
+    static struct delta_record delta_heads[TXN_MAX_BLOCKS * TXN_MAX_EXTENTS];
+    static const uint8_t zero_pad[BLOCK_SIZE];
+    static struct iovec iov[3 * TXN_MAX_BLOCKS * TXN_MAX_EXTENTS + 1];
+    struct commit_record commit;
+    int iovcnt = 0;
+    int ndeltas = 0;
+
+    for (uint32_t i = 0; i < txn->nblocks; i++) {
+        if (nextents[i] < 0) {
+            rec_heads[i].hdr.type = REC_DATA;
+            rec_heads[i].hdr.size = sizeof(struct data_record);
+            rec_heads[i].block_no = txn->block_no[i];
+            iov[iovcnt].iov_base = &rec_heads[i];
+            iov[iovcnt++].iov_len = sizeof(rec_heads[i]);
+            iov[iovcnt].iov_base = txn->data[i];
+            iov[iovcnt++].iov_len = BLOCK_SIZE;
+            continue;
+        }
+        for (int e = 0; e < nextents[i]; e++) {
+            struct delta_record *d = &delta_heads[ndeltas++];
+            uint32_t size = delta_record_size(extents[i][e].length);
+            d->hdr.type = REC_DELTA;
+            d->hdr.size = (uint16_t)size;
+            d->block_no = txn->block_no[i];
+            d->offset = extents[i][e].offset;
+            d->length = extents[i][e].length;
+            iov[iovcnt].iov_base = d;
+            iov[iovcnt++].iov_len = sizeof(*d);
+            iov[iovcnt].iov_base = txn->data[i] + d->offset;
+            iov[iovcnt++].iov_len = d->length;
+            if (size > sizeof(*d) + d->length) {
+                iov[iovcnt].iov_base = (void *)zero_pad;
+                iov[iovcnt++].iov_len = size - sizeof(*d) - d->length;
+            }
+        }
+    }
+
+    // Checksum covers every record byte before the commit
+    uint32_t crc = CRC32C_INIT;
+    for (int i = 0; i < iovcnt; i++) {
+        crc = crc32c_update(crc, iov[i].iov_base, iov[i].iov_len);
+    }
+    commit.hdr.type = REC_COMMIT;
+    commit.hdr.size = sizeof(struct commit_record);
+    commit.seq = jh.tail_seq;
+    crc = crc32c_update(crc, &commit.seq, sizeof(commit.seq));
+    commit.checksum = ~crc;
+    iov[iovcnt].iov_base = &commit;
+    iov[iovcnt++].iov_len = sizeof(commit);
+
+    overlay_append(iov, iovcnt, jh.tail);
+    jh.tail = (jh.tail + txn_bytes) % journal_capacity(sb);
+    jh.nbytes_used += txn_bytes;
+    jh.tail_seq++;
+    overlay.jh = jh;
+    if (txn->ordered_blocks > 0) group.ordered = 1;
+    icache_refresh(sb, txn);
+
+    phase_end(&timer);
+
+    // Readers and other transactions see the new images from here on
+    txn->queued = 1;
+    txn_release(txn);
+    phase_begin(&timer, PHASE_COMMIT);
+    journal_wait_durable(sb, commit.seq);
+    phase_end(&timer);
+
+    double latency_ms = elapsed_ms(&started);
+    commit_latency.commits++;
+    commit_latency.total_ms += latency_ms;
+    if (latency_ms > commit_latency.max_ms) commit_latency.max_ms = latency_ms;
+
+    printf("  Journal transaction %u complete (%u blocks, %u record bytes, bytes used: %u / %u, %.3f ms)\n",
+           commit.seq, logged_blocks, txn_bytes, jh.nbytes_used, journal_capacity(sb), latency_ms);
+    if (txn->ordered_blocks > 0) {
+        printf("    %llu data blocks written in place, not logged\n", (unsigned long long)txn->ordered_blocks);
+    }
+
+    // Checkpointing is deferred until the log is mostly full
+    int result = 0;
+    if (overlay.loaded && (uint64_t)overlay.jh.nbytes_used * 100 >
+                          (uint64_t)journal_capacity(sb) * JOURNAL_HIGH_WATER_PCT) {
+        printf("  Journal past %u%% full, checkpointing...\n", JOURNAL_HIGH_WATER_PCT);
+        result = journal_checkpoint_locked(sb, stdout);
+    }
+    pthread_mutex_unlock(&journal_mutex);
+    return result;
+}
+
+
+/* ===================== Bitmap Allocator ===================== */
+
+/*
+ * One allocator per bitmap region. Searches start at a next-fit hint just
+ * past the last allocation rather than at bit 0, and a per-block free count
+ * (built with popcount on first use) lets full bitmap blocks be skipped
+ * without reading them. A run of bits never spans two bitmap blocks.
+ * A transaction holds the allocator's lock from its first search until its
+ * records are queued, so the bits it finds stay free until it takes them.
+ */
+struct bitmap_alloc {
+    uint32_t first_block;   // first bitmap block on disk
+    uint32_t nblocks;       // bitmap blocks in the region
+    uint32_t nbits;         // bits that describe real inodes or data blocks
+    uint32_t hint;          // next-fit: where the next search starts
+    uint32_t *free_count;   // free bits per bitmap block, NULL until needed
+    int counter;            // index into transaction taken[]: 0 inodes, 1 data blocks
+    pthread_mutex_t lock;
+};
+
+struct bitmap_alloc inode_alloc;
+struct bitmap_alloc data_alloc;
+
+void bitmap_alloc_init(const struct superblock *sb) {
+    inode_alloc = (struct bitmap_alloc){
+        .first_block = sb->inode_bitmap,
+        .nblocks = sb->data_bitmap - sb->inode_bitmap,
+        .nbits = sb->inode_count,
+        .counter = 0,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+    };
+    data_alloc = (struct bitmap_alloc){
+        .first_block = sb->data_bitmap,
+        .nblocks = sb->inode_start - sb->data_bitmap,
+        .nbits = sb->total_blocks - sb->data_start,
+        .counter = 1,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+    };
+}
+
+uint32_t bitmap_alloc_block_bits(const struct bitmap_alloc *ba, uint32_t b) {
+    uint32_t first = b * BLOCK_SIZE * 8;
+    if (first >= ba->nbits) return 0;
+    return ba->nbits - first < BLOCK_SIZE * 8 ? ba->nbits - first : BLOCK_SIZE * 8;
+}
+
+// The transaction's copy of a bitmap block if it has one, else the committed one
+const uint8_t *bitmap_alloc_view(const struct superblock *sb, struct transaction *txn,
+                                 uint32_t block_num, uint8_t *scratch) {
+    const uint8_t *data = txn ? txn_find_block(txn, block_num) : NULL;
+    if (data) return data;
+    read_bitmap_block(sb, block_num, scratch);
+    return scratch;
+}
+
+int bitmap_alloc_load(const struct superblock *sb, struct bitmap_alloc *ba) {
+    if (ba->free_count) return 0;
+    ba->free_count = calloc(ba->nblocks, sizeof(uint32_t));
+    if (!ba->free_count) {
+        fprintf(stderr, "Error: Out of memory for bitmap summary\n");
+        return -1;
+    }
+    uint8_t bitmap[BLOCK_SIZE];
+    for (uint32_t b = 0; b < ba->nblocks; b++) {
+        uint32_t nbits = bitmap_alloc_block_bits(ba, b);
+        if (nbits == 0) break;
+        read_bitmap_block(sb, ba->first_block + b, bitmap);
+        ba->free_count[b] = nbits - bitmap_count(bitmap, nbits);
+    }
+    return 0;
+}
+
+uint64_t bitmap_alloc_free(const struct superblock *sb, struct bitmap_alloc *ba) {
+    if (bitmap_alloc_load(sb, ba) < 0) return 0;
+    uint64_t total = 0;
+    for (uint32_t b = 0; b < ba->nblocks; b++) {
+        total += ba->free_count[b];
+    }
+    return total;
+}
+
+/*
+ * Images from before the superblock counters get them from the bitmaps in a
+ * transaction of their own, once, when a write command starts and before
+ * it runs any other; read-only commands leave such images as they are.
+ */
+int free_counts_enable(const struct superblock *sb) {
+    uint8_t super[BLOCK_SIZE];
+    read_fs_block(sb, 0, super);
+    if (((const struct superblock *)super)->features & FS_FEATURE_FREE_COUNTS) return 0;
+
+    static struct transaction txn;
+    txn_begin(&txn);
+    txn_hold(&txn, &inode_alloc.lock);
+    txn_hold(&txn, &data_alloc.lock);
+    struct superblock *counts = (struct superblock *)txn_get_block(sb, &txn, 0);
+    if (!counts) {
+        txn_release(&txn);
+        return -1;
+    }
+    counts->free_inodes = (uint32_t)bitmap_alloc_free(sb, &inode_alloc);
+    counts->free_blocks = (uint32_t)bitmap_alloc_free(sb, &data_alloc);
+    counts->features |= FS_FEATURE_FREE_COUNTS;
+    return txn_commit(sb, &txn);
+}
+
+/*
+ * Finds n contiguous free bits, searching from the hint to the end of the
+ * region and then wrapping round to it. Nothing is marked; call
+ * bitmap_alloc_take once the caller is sure it will use them. Returns the
+ * first bit or -1.
+ */
+int64_t bitmap_alloc_find(const struct superblock *sb, struct transaction *txn,
+                          struct bitmap_alloc *ba, uint32_t n) {
+    if (txn) txn_hold(txn, &ba->lock);   // read-only callers pass no transaction
+    if (n == 0 || n > BLOCK_SIZE * 8 || bitmap_alloc_load(sb, ba) < 0) return -1;
+    uint32_t hint = ba->hint < ba->nbits ? ba->hint : 0;
+    uint32_t hint_block = hint / (BLOCK_SIZE * 8);
+    uint8_t scratch[BLOCK_SIZE];
+
+    // The hint block is visited twice: from the hint on, and finally below it
+    for (uint32_t step = 0; step <= ba->nblocks; step++) {
+        uint32_t b = (hint_block + step) % ba->nblocks;
+        uint32_t nbits = bitmap_alloc_block_bits(ba, b);
+        if (ba->free_count[b] < n || nbits < n) continue;
+        uint32_t from = 0, to = nbits;
+        if (step == 0) {
+            from = hint % (BLOCK_SIZE * 8);
+        } else if (step == ba->nblocks) {
+            to = hint % (BLOCK_SIZE * 8) + n - 1;
+            if (to > nbits) to = nbits;
+        }
+        const uint8_t *bitmap = bitmap_alloc_view(sb, txn, ba->first_block + b, scratch);
+        int bit = bitmap_find_run(bitmap, from, to, n);
+        if (bit >= 0) {
+            return (int64_t)b * BLOCK_SIZE * 8 + bit;
+        }
+    }
+    return -1;
+}
+
+// Marks n bits from first as used in the transaction and moves the hint past
+// them. The superblock joins the transaction too; its counters follow at commit
+int bitmap_alloc_take(const struct superblock *sb, struct transaction *txn,
+                      struct bitmap_alloc *ba, uint32_t first, uint32_t n) {
+    txn_hold(txn, &ba->lock);
+    uint32_t b = first / (BLOCK_SIZE * 8);
+    uint8_t *bitmap = txn_get_block(sb, txn, ba->first_block + b);
+    if (!bitmap || !txn_get_block(sb, txn, 0)) return -1;
+    if (txn->taken[ba->counter] == 0) txn->hint[ba->counter] = ba->hint;
+    txn->taken[ba->counter] += n;
+    for (uint32_t i = 0; i < n; i++) {
+        set_bit(bitmap, (int)(first % (BLOCK_SIZE * 8) + i));
+    }
+    ba->free_count[b] -= n;
+    ba->hint = first + n;
+    return 0;
+}
+
+
+/* ===================== Inode Block Map ===================== */
+
+// Adds blocks start..start+length-1 after the last extent, merging if adjacent
+int extent_list_append(struct extent *ext, int n, uint32_t start, uint32_t length) {
+    if (n > 0 && ext[n - 1].start + ext[n - 1].length == start) {
+        ext[n - 1].length += length;
+        return n;
+    }
+    ext[n].start = start;
+    ext[n].length = length;
+    return n + 1;
+}
+
+/*
+ * Callers see every inode's map as a list of extents in file order; direct
+ * pointers come back as one-block extents. The indirect extent block is
+ * taken from txn when it has a copy. Returns the number of extents.
+ */
+int inode_get_extents(const struct superblock *sb, struct transaction *txn, const struct inode *inode,
+                      struct extent *ext) {
+    int n = 0;
+    if (!(inode->flags & INODE_EXTENTS)) {
+        for (int i = 0; i < 8 && inode->direct[i] != 0; i++) {
+            n = extent_list_append(ext, n, inode->direct[i], 1);
+        }
+        return n;
+    }
+    for (int i = 0; i < INODE_DIRECT_EXTENTS && inode->extents[i].length != 0; i++) {
+        ext[n++] = inode->extents[i];
+    }
+    if (n == INODE_DIRECT_EXTENTS && inode->extent_block != 0) {
+        uint8_t block[BLOCK_SIZE];
+        const uint8_t *src = txn ? txn_find_block(txn, inode->extent_block) : NULL;
+        if (!src) {
+            read_fs_block(sb, inode->extent_block, block);
+            src = block;
+        }
+        const struct extent *more = (const struct extent *)src;
+        for (uint32_t i = 0; i < EXTENTS_PER_BLOCK && more[i].length != 0; i++) {
+            ext[n++] = more[i];
+        }
+    }
+    return n;
+}
+
+// Disk block holding logical block lblock, or 0 past the end of the map
+uint32_t extent_lookup(const struct extent *ext, int n, uint32_t lblock) {
+    for (int i = 0; i < n; i++) {
+        if (lblock < ext[i].length) return ext[i].start + lblock;
+        lblock -= ext[i].length;
+    }
+    return 0;
+}
+
+uint32_t extent_blocks(const struct extent *ext, int n) {
+    uint32_t total = 0;
+    for (int i = 0; i < n; i++) total += ext[i].length;
+    return total;
+}
+
+// Whether storing ext in inode would need an indirect block it does not have
+int inode_extents_need_block(const struct inode *inode, const struct extent *ext, int n) {
+    if (!(inode->flags & INODE_EXTENTS) && extent_blocks(ext, n) <= 8) return 0;
+    return n > INODE_DIRECT_EXTENTS && inode->extent_block == 0;
+}
+
+/*
+ * Stores ext as the inode's map. Inodes stay on direct pointers while every
+ * block fits in one; after that they switch to extents for good. spare_block
+ * is a data block the caller has already allocated for the indirect extent
+ * block in case one is needed. The inode and indirect block must already be
+ * in txn.
+ */
+int inode_set_extents(const struct superblock *sb, struct transaction *txn, struct inode *inode,
+                      const struct extent *ext, int n, uint32_t spare_block) {
+    if (n > (int)INODE_MAX_EXTENTS) {
+        return -1;
+    }
+    if (!(inode->flags & INODE_EXTENTS) && extent_blocks(ext, n) <= 8) {
+        memset(inode->direct, 0, sizeof(inode->direct));
+        for (uint32_t lblock = 0; lblock < extent_blocks(ext, n); lblock++) {
+            inode->direct[lblock] = extent_lookup(ext, n, lblock);
+        }
+        return 0;
+    }
+    if (n > INODE_DIRECT_EXTENTS && inode->extent_block == 0) {
+        if (spare_block == 0) return -1;
+        inode->extent_block = spare_block;
+    }
+    inode->flags |= INODE_EXTENTS;
+    memset(inode->extents, 0, sizeof(inode->extents));
+    for (int i = 0; i < n && i < INODE_DIRECT_EXTENTS; i++) {
+        inode->extents[i] = ext[i];
+    }
+    if (inode->extent_block != 0) {
+        uint8_t *block = txn_get_block(sb, txn, inode->extent_block);
+        if (!block) return -1;
+        memset(block, 0, BLOCK_SIZE);
+        for (int i = INODE_DIRECT_EXTENTS; i < n; i++) {
+            ((struct extent *)block)[i - INODE_DIRECT_EXTENTS] = ext[i];
+        }
+    }
+    return 0;
+}
+
+
+/* ===================== Directory Index ===================== */
+
+/*
+ * A directory is an array of dirents spread over the blocks its inode maps;
+ * entry pos lives in logical block pos / DIRENTS_PER_BLOCK. Name lookups go
+ * through an in-memory hash table of the root directory, built on first
+ * access, and free slots below the end of the directory are kept on a
+ * stack, so a create costs the same however many entries there are.
+ * root_dir_lock covers the index and the root directory's inode and blocks;
+ * creates hold it until their transaction is queued.
+ */
+struct dir_slot {
+    uint32_t pos_plus1;         // 0 = empty table slot
+    uint32_t hash;
+    uint32_t inum;
+    char     name[NAME_LEN];
+};
+
+struct dir_index {
+    int loaded;
+    uint32_t nentries;
+    uint32_t capacity;          // hash table size, a power of two
+    struct dir_slot *table;
+    uint32_t *free_pos;         // unused dirent positions below end, lowest on top
+    uint32_t nfree;
+    uint32_t end;               // positions covered by the directory's size
+};
+
+struct dir_index root_index;
+pthread_mutex_t root_dir_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t dir_hash(const char *name) {
+    uint32_t h = 2166136261U;   // FNV-1a
+    for (int i = 0; i < NAME_LEN && name[i]; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619U;
+    }
+    return h;
+}
+
+// Grows the table if needed so that inserting one more name cannot fail
+int dir_index_reserve(struct dir_index *idx) {
+    if ((idx->nentries + 1) * 10 <= idx->capacity * 7) return 0;
+    uint32_t capacity = idx->capacity ? idx->capacity * 2 : 256;
+    struct dir_slot *table = calloc(capacity, sizeof(struct dir_slot));
+    if (!table) {
+        fprintf(stderr, "Error: Out of memory for directory index\n");
+        return -1;
+    }
+    for (uint32_t i = 0; i < idx->capacity; i++) {
+        if (!idx->table[i].pos_plus1) continue;
+        uint32_t j = idx->table[i].hash & (capacity - 1);
+        while (table[j].pos_plus1) j = (j + 1) & (capacity - 1);
+        table[j] = idx->table[i];
+    }
+    free(idx->table);
+    idx->table = table;
+    idx->capacity = capacity;
+    return 0;
+}
+
+int dir_index_insert(struct dir_index *idx, const char *name, uint32_t pos, uint32_t inum) {
+    if (dir_index_reserve(idx) < 0) return -1;
+    uint32_t h = dir_hash(name);
+    uint32_t j = h & (idx->capacity - 1);
+    while (idx->table[j].pos_plus1) j = (j + 1) & (idx->capacity - 1);
+    idx->table[j].pos_plus1 = pos + 1;
+    idx->table[j].hash = h;
+    idx->table[j].inum = inum;
+    memcpy(idx->table[j].name, name, strnlen(name, NAME_LEN));
+    idx->nentries++;
+    return 0;
+}
+
+// Position of the entry called name, or -1; its inode goes to *inum_out if given
+int64_t dir_index_lookup(const struct dir_index *idx, const char *name, uint32_t *inum_out) {
+    if (idx->capacity == 0) return -1;
+    uint32_t h = dir_hash(name);
+    for (uint32_t j = h & (idx->capacity - 1); idx->table[j].pos_plus1; j = (j + 1) & (idx->capacity - 1)) {
+        if (idx->table[j].hash == h && strncmp(idx->table[j].name, name, NAME_LEN) == 0) {
+            if (inum_out) *inum_out = idx->table[j].inum;
+            return idx->table[j].pos_plus1 - 1;
+        }
+    }
+    return -1;
+}
+
+int dir_index_load(const struct superblock *sb, struct dir_index *idx) {
+    if (idx->loaded) return 0;
+    struct phase_timer timer;
+    phase_begin(&timer, PHASE_DIR_SCAN);
+    struct inode root;
+    read_inode(sb, 0, &root);
+    if (root.type != 2) {
+        fprintf(stderr, "Error: Root inode is not a directory\n");
+        return -1;
+    }
+    idx->end = root.size / sizeof(struct dirent);
+    idx->free_pos = malloc((idx->end + 1) * sizeof(uint32_t));
+    if (!idx->free_pos) {
+        fprintf(stderr, "Error: Out of memory for directory index\n");
+        return -1;
+    }
+    static struct extent ext[INODE_MAX_EXTENTS];
+    int next = inode_get_extents(sb, NULL, &root, ext);
+    uint8_t block[BLOCK_SIZE];
+    const struct dirent *entries = (const struct dirent *)block;
+    for (uint32_t pos = 0; pos < idx->end; pos++) {
+        if (pos % DIRENTS_PER_BLOCK == 0) {
+            uint32_t block_num = extent_lookup(ext, next, pos / DIRENTS_PER_BLOCK);
+            if (block_num == 0) {
+                memset(block, 0, sizeof(block));
+            } else {
+                read_fs_block(sb, block_num, block);
+            }
+        }
+        const struct dirent *de = &entries[pos % DIRENTS_PER_BLOCK];
+        if (!dirent_in_use(de)) {
+            idx->free_pos[idx->nfree++] = pos;
+        } else if (dir_index_insert(idx, de->name, pos, de->inode) < 0) {
+            return -1;
+        }
+    }
+    // Reverse so the lowest free position is popped first
+    for (uint32_t i = 0; i < idx->nfree / 2; i++) {
+        uint32_t t = idx->free_pos[i];
+        idx->free_pos[i] = idx->free_pos[idx->nfree - 1 - i];
+        idx->free_pos[idx->nfree - 1 - i] = t;
+    }
+    idx->loaded = 1;
+    phase_end(&timer);
+    return 0;
+}
+
+// Where the next entry goes: the lowest hole, else the end of the directory
+uint32_t dir_index_next_pos(const struct dir_index *idx) {
+    return idx->nfree ? idx->free_pos[idx->nfree - 1] : idx->end;
+}
+
+// Records that pos (from dir_index_next_pos) now holds name
+int dir_index_add(struct dir_index *idx, const char *name, uint32_t pos, uint32_t inum) {
+    if (idx->nfree && idx->free_pos[idx->nfree - 1] == pos) {
+        idx->nfree--;
+    } else {
+        idx->end = pos + 1;
+    }
+    return dir_index_insert(idx, name, pos, inum);
+}
+
+// Forgets the index; the next dir_index_load rebuilds it from the committed directory
+void dir_index_reset(struct dir_index *idx) {
+    free(idx->table);
+    free(idx->free_pos);
+    memset(idx, 0, sizeof(*idx));
+}
+
+/*
+ * Puts back what a transaction that will not be queued changed outside its
+ * blocks, while it still holds the locks guarding that state. The root
+ * directory index already lists its new names, so it is rebuilt. Each
+ * allocator gets back the free bits the transaction took, which are the
+ * bits its bitmap blocks set over their base, and its hint from before the
+ * first take. Safe to call again: what was undone is forgotten.
+ */
+void txn_undo(struct transaction *txn) {
+    if (txn->dir_changed) {
+        dir_index_reset(&root_index);
+        txn->dir_changed = 0;
+    }
+    struct bitmap_alloc *allocs[2] = { &inode_alloc, &data_alloc };
+    for (int c = 0; c < 2; c++) {
+        struct bitmap_alloc *ba = allocs[c];
+        if (txn->taken[c] == 0) continue;
+        for (uint32_t i = 0; i < txn->nblocks; i++) {
+            uint32_t b = txn->block_no[i] - ba->first_block;
+            if (txn->block_no[i] < ba->first_block || b >= ba->nblocks) continue;
+            for (uint32_t w = 0; w < BLOCK_SIZE / sizeof(uint64_t); w++) {
+                uint64_t base, data;
+                memcpy(&base, txn->base[i] + w * sizeof(uint64_t), sizeof(uint64_t));
+                memcpy(&data, txn->data[i] + w * sizeof(uint64_t), sizeof(uint64_t));
+                ba->free_count[b] += (uint32_t)__builtin_popcountll(data & ~base);
+            }
+        }
+        ba->hint = txn->hint[c];
+        txn->taken[c] = 0;
+    }
+}
+
 
 /* ===================== CREATE Command Implementation ===================== */
 
-int do_create(const struct superblock *sb, const char *filename) {
-    printf("Creating file: %s\n", filename);
-    
+/*
+ * Adds one empty file to the root directory inside txn. Every step that can
+ * fail, from the checks to reading blocks and growing the directory index,
+ * comes before the first change. A failed name therefore leaves block
+ * contents, the allocators and the indexed names as they were. The
+ * transaction may still have gained locks and unchanged copies of blocks,
+ * so a batch can carry on with the next name and commit what the others
+ * changed.
+ */
+int create_in_txn(const struct superblock *sb, struct transaction *txn, const char *filename,
+                  int *inum_out, int *slot_out) {
     // Validate filename length
-    if (strlen(filename) >= NAME_LEN) {
-        fprintf(stderr, "Error: Filename too long (max %d chars)\n", NAME_LEN - 1);
+    if (filename[0] == '\0' || strlen(filename) >= NAME_LEN) {
+        fprintf(stderr, "Error: Filename '%s' must be 1-%d chars\n", filename, NAME_LEN - 1);
         return -1;
     }
     
-    // Step 1: Read inode bitmap
-    uint8_t inode_bitmap[BLOCK_SIZE];
-    read_bitmap_block(sb->inode_bitmap, inode_bitmap);
-    
-    // Step 2: Read root directory inode (inode 0 is root)
-    struct inode root_inode;
-    read_inode(sb, 0, &root_inode);
+    // Step 1: Read root directory inode (inode 0 is root) and its index
+    txn_hold(txn, &root_dir_lock);
+    struct inode *root_inode = txn_get_inode(sb, txn, 0);
+    if (!root_inode) {
+        return -1;
+    }
     
-    if (root_inode.type != 2) {
+    if (root_inode->type != 2) {
         fprintf(stderr, "Error: Root inode is not a directory\n");
         return -1;
     }
+    if (dir_index_load(sb, &root_index) < 0) {
+        return -1;
+    }
     
-    // Step 3: Read root directory data block
-    uint32_t root_data_block = root_inode.direct[0];
-    uint8_t dir_block[BLOCK_SIZE];
-    read_block_raw(root_data_block, dir_block);
-    
-    // Step 4: Check if file already exists
-    if (find_dirent_by_name(dir_block, filename) >= 0) {
+    // Step 2: Check if file already exists
+    if (dir_index_lookup(&root_index, filename, NULL) >= 0) {
         fprintf(stderr, "Error: File '%s' already exists\n", filename);
         return -1;
     }
     
-    // Step 5: Find free directory slot
-    int slot = find_free_dirent_slot(dir_block);
-    if (slot < 0) {
-        fprintf(stderr, "Error: Root directory is full\n");
-        return -1;
+    // Step 3: Find free directory slot, growing the directory by a block if
+    // needed (plus an indirect extent block once its map outgrows the inode)
+    static __thread struct extent ext[INODE_MAX_EXTENTS + 1];
+    int next = inode_get_extents(sb, txn, root_inode, ext);
+    uint32_t pos = dir_index_next_pos(&root_index);
+    uint32_t dir_block_num = extent_lookup(ext, next, pos / DIRENTS_PER_BLOCK);
+    int64_t new_data = -1;
+    uint32_t spare_block = 0;
+    if (dir_block_num == 0) {
+        if (next == (int)INODE_MAX_EXTENTS) {
+            fprintf(stderr, "Error: Root directory is full\n");
+            return -1;
+        }
+        new_data = bitmap_alloc_find(sb, txn, &data_alloc, 1);
+        if (new_data >= 0) {
+            dir_block_num = sb->data_start + (uint32_t)new_data;
+            next = extent_list_append(ext, next, dir_block_num, 1);
+            if (inode_extents_need_block(root_inode, ext, next)) {
+                new_data = bitmap_alloc_find(sb, txn, &data_alloc, 2);
+                dir_block_num = sb->data_start + (uint32_t)new_data;
+                spare_block = dir_block_num + 1;
+                next = inode_get_extents(sb, txn, root_inode, ext);
+                next = extent_list_append(ext, next, dir_block_num, 1);
+            }
+        }
+        if (new_data < 0) {
+            fprintf(stderr, "Error: No free data blocks for directory\n");
+            return -1;
+        }
     }
     
-    // Step 6: Find free inode
-    int new_inum = find_free_inode(sb, inode_bitmap);
+    // Step 4: Find free inode
+    int64_t new_inum = bitmap_alloc_find(sb, txn, &inode_alloc, 1);
     if (new_inum < 0) {
         fprintf(stderr, "Error: No free inodes available\n");
         return -1;
     }
     
-    printf("  Allocated inode: %d\n", new_inum);
-    printf("  Directory slot: %d\n", slot);
-    
-    // ===== Prepare modified blocks in memory =====
-    
-    // Modified inode bitmap
-    uint8_t new_inode_bitmap[BLOCK_SIZE];
-    memcpy(new_inode_bitmap, inode_bitmap, BLOCK_SIZE);
-    set_bit(new_inode_bitmap, new_inum);
+    // Step 5: Pull every block the create modifies into the transaction,
+    // so nothing below can fail half way
+    struct inode *inode = txn_get_inode(sb, txn, (uint32_t)new_inum);
+    uint8_t *dir_block = txn_get_block(sb, txn, dir_block_num);
+    uint8_t *inode_bitmap = txn_get_block(sb, txn,
+                                          inode_alloc.first_block + (uint32_t)new_inum / (BLOCK_SIZE * 8));
+    uint8_t *data_bitmap = new_data < 0 ? inode_bitmap :
+        txn_get_block(sb, txn, data_alloc.first_block + (uint32_t)new_data / (BLOCK_SIZE * 8));
+    uint32_t extent_block = spare_block ? spare_block : root_inode->extent_block;
+    uint8_t *indirect = extent_block == 0 ? inode_bitmap : txn_get_block(sb, txn, extent_block);
+    uint8_t *super = txn_get_block(sb, txn, 0);
+    if (!inode || !dir_block || !inode_bitmap || !data_bitmap || !indirect || !super) {
+        return -1;
+    }
+    if (dir_index_reserve(&root_index) < 0) {
+        return -1;
+    }
     
-    // Modified inode block
-    uint32_t inodes_per_block = BLOCK_SIZE / sizeof(struct inode);
-    uint32_t inode_block_index = new_inum / inodes_per_block;
-    uint32_t inode_offset = new_inum % inodes_per_block;
-    uint32_t inode_block_num = sb->inode_start + inode_block_index;
+    // ===== Modify blocks in the transaction =====
     
-    uint8_t inode_block[BLOCK_SIZE];
-    read_block_raw(inode_block_num, inode_block);
+    bitmap_alloc_take(sb, txn, &inode_alloc, (uint32_t)new_inum, 1);
+    if (new_data >= 0) {
+        // A fresh directory block; whatever the free block held is garbage
+        bitmap_alloc_take(sb, txn, &data_alloc, (uint32_t)new_data, spare_block ? 2 : 1);
+        memset(dir_block, 0, BLOCK_SIZE);
+        inode_set_extents(sb, txn, root_inode, ext, next, spare_block);
+    }
     
     // Create new inode for the file
     struct inode new_inode;
@@ -359,157 +2818,761 @@ int do_create(const struct superblock *sb, const char *filename) {
     new_inode.ctime = (uint32_t)time(NULL);
     new_inode.mtime = new_inode.ctime;
     
-    write_inode_to_buffer(inode_block, inode_offset, &new_inode);
+    *inode = new_inode;
+    
+    // Root directory must grow to cover the new slot
+    uint32_t dir_end = (pos + 1) * sizeof(struct dirent);
+    if (root_inode->size < dir_end) root_inode->size = dir_end;
+    root_inode->mtime = new_inode.ctime;
     
-    // Modified directory block
-    uint8_t new_dir_block[BLOCK_SIZE];
-    memcpy(new_dir_block, dir_block, BLOCK_SIZE);
-    struct dirent *entries = (struct dirent *)new_dir_block;
-    entries[slot].inode = new_inum;
+    struct dirent *entries = (struct dirent *)dir_block;
+    uint32_t slot = pos % DIRENTS_PER_BLOCK;
+    entries[slot].inode = (uint32_t)new_inum;
     strncpy(entries[slot].name, filename, NAME_LEN - 1);
     entries[slot].name[NAME_LEN - 1] = '\0';
     
-    // ===== Write to Journal =====
+    // Cannot fail, the index has room reserved
+    txn->dir_changed = 1;
+    dir_index_add(&root_index, entries[slot].name, pos, (uint32_t)new_inum);
     
-    struct journal_header jh;
-    read_journal_header(sb, &jh);
+    *inum_out = (int)new_inum;
+    *slot_out = (int)pos;
+    return 0;
+}
+
+int do_create(const struct superblock *sb, const char *filename) {
+    printf("Creating file: %s\n", filename);
+    if (free_counts_enable(sb) < 0) {
+        return -1;
+    }
     
-    if (jh.magic != JOURNAL_MAGIC) {
-        fprintf(stderr, "Error: Invalid journal magic\n");
+    // Every block is read once into the transaction and modified in place
+    struct transaction txn;
+    txn_begin(&txn);
+    
+    int new_inum, slot;
+    if (create_in_txn(sb, &txn, filename, &new_inum, &slot) < 0) {
+        txn_release(&txn);
         return -1;
     }
     
-    // Reset journal for new transaction
-    jh.nbytes_used = sizeof(struct journal_header);
+    printf("  Allocated inode: %d\n", new_inum);
+    printf("  Directory slot: %d\n", slot);
+    
+    // ===== Write to Journal =====
     
     printf("  Writing to journal...\n");
+    for (uint32_t i = 0; i < txn.nblocks; i++) {
+        printf("    - Block %u\n", txn.block_no[i]);
+    }
+    printf("    - Commit record\n");
+    
+    if (txn_commit(sb, &txn) < 0) {
+        return -1;
+    }
+    
+    printf("File '%s' created successfully (pending install)\n", filename);
+    
+    return 0;
+}
+
+
+/* ===================== CREATE-BATCH Command Implementation ===================== */
+
+/*
+ * Creates one file per line of names_path ("-" for stdin). Files accumulate
+ * in a single transaction, so the bitmap, inode and directory blocks are each
+ * logged once per transaction rather than once per file. A new transaction is
+ * started only when the current one runs short of block slots. With
+ * --threads=N, N workers pull names from the same input, each with its own
+ * transaction; while one worker waits for its commit to reach the disk the
+ * next builds its transaction, and group commit writes them out together.
+ */
+int batch_threads = 1;
+
+struct batch_worker {
+    const struct superblock *sb;
+    FILE *in;
+    int created;
+    int failed;
+    int transactions;
+    int result;
+};
+
+void *create_batch_worker(void *arg) {
+    struct batch_worker *w = arg;
+    struct transaction *txn = malloc(sizeof(*txn));
+    if (!txn) {
+        fprintf(stderr, "Error: Out of memory for transaction\n");
+        w->result = -1;
+        return NULL;
+    }
+    txn_begin(txn);
+    
+    char line[256];
+    while (fgets(line, sizeof(line), w->in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') continue;
+        
+        // Worst case a create touches six blocks nobody else has yet
+        if (txn->nblocks > TXN_MAX_BLOCKS - 6) {
+            if (txn_commit(w->sb, txn) < 0) {
+                w->result = -1;
+                break;
+            }
+            w->transactions++;
+            txn_begin(txn);
+        }
+        
+        int new_inum, slot;
+        if (create_in_txn(w->sb, txn, line, &new_inum, &slot) < 0) {
+            w->failed++;
+            continue;
+        }
+        w->created++;
+    }
+    
+    if (w->result == 0 && txn->nblocks > 0 && w->created > 0) {
+        if (txn_commit(w->sb, txn) < 0) {
+            w->result = -1;
+        } else {
+            w->transactions++;
+        }
+    }
+    txn_release(txn);
+    free(txn);
+    return NULL;
+}
+
+int do_create_batch(const struct superblock *sb, const char *names_path) {
+    if (free_counts_enable(sb) < 0) {
+        return -1;
+    }
+    FILE *in = stdin;
+    if (strcmp(names_path, "-") != 0) {
+        in = fopen(names_path, "r");
+        if (!in) {
+            fprintf(stderr, "Error: Cannot open '%s': %s\n", names_path, strerror(errno));
+            return -1;
+        }
+    }
+    
+    struct batch_worker workers[batch_threads];
+    pthread_t tids[batch_threads];
+    int started = 0;
+    for (int t = 0; t < batch_threads; t++) {
+        workers[t] = (struct batch_worker){ .sb = sb, .in = in };
+    }
+    if (batch_threads == 1) {
+        create_batch_worker(&workers[0]);
+        started = 1;
+    } else {
+        for (; started < batch_threads; started++) {
+            if (pthread_create(&tids[started], NULL, create_batch_worker, &workers[started]) != 0) {
+                fprintf(stderr, "Error: Cannot start worker thread: %s\n", strerror(errno));
+                break;
+            }
+        }
+        for (int t = 0; t < started; t++) {
+            pthread_join(tids[t], NULL);
+        }
+    }
     
-    // Append DATA record for inode bitmap
-    if (append_data_record(sb, &jh, sb->inode_bitmap, new_inode_bitmap) < 0) {
+    if (in != stdin) fclose(in);
+    
+    int created = 0;
+    int failed = 0;
+    int transactions = 0;
+    int result = started == 0 ? -1 : 0;
+    for (int t = 0; t < started; t++) {
+        created += workers[t].created;
+        failed += workers[t].failed;
+        transactions += workers[t].transactions;
+        if (workers[t].result < 0) result = -1;
+    }
+    
+    printf("Batch complete: %d created, %d failed, %d transaction(s) (pending install)\n",
+           created, failed, transactions);
+    return (result < 0 || failed > 0) ? -1 : 0;
+}
+
+
+/* ===================== WRITE / READ Command Implementation ===================== */
+
+/*
+ * write streams stdin in batches of up to STREAM_BATCH_BLOCKS, allocates
+ * each batch as few contiguous runs as the data bitmap allows, and writes
+ * every run home with one vectored write as ordered data; only the bitmap,
+ * inode and extent blocks are journaled. A file too big for one
+ * transaction's worth of bitmap blocks is committed in steps, each leaving
+ * a consistent, shorter file.
+ */
+#define STREAM_BATCH_BLOCKS 256     // 1 MiB
+#define INODE_LOCK_STRIPES 64
+
+// A writer holds its file's inode lock, after the data allocator's
+pthread_mutex_t inode_locks[INODE_LOCK_STRIPES] = {
+    [0 ... INODE_LOCK_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+pthread_mutex_t *inode_lock(uint32_t inum) {
+    return &inode_locks[inum % INODE_LOCK_STRIPES];
+}
+
+// Reads until len bytes or end of input; returns the count
+size_t read_full(int fd, uint8_t *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            fprintf(stderr, "Error: Reading input failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (n == 0) break;
+        got += (size_t)n;
+    }
+    return got;
+}
+
+// Maps blocks start..start+n-1 onto the end of the file's data
+int file_append_run(const struct superblock *sb, struct transaction *txn, struct inode *inode,
+                    uint32_t bit, uint32_t n) {
+    static __thread struct extent ext[INODE_MAX_EXTENTS + 1];
+    int next = inode_get_extents(sb, txn, inode, ext);
+    next = extent_list_append(ext, next, sb->data_start + bit, n);
+    if (next > (int)INODE_MAX_EXTENTS) {
+        fprintf(stderr, "Error: File is too fragmented (more than %zu extents)\n", INODE_MAX_EXTENTS);
+        return -1;
+    }
+    // Take the run before looking for an extent block, or the search would find it
+    if (!txn_get_block(sb, txn, data_alloc.first_block + bit / (BLOCK_SIZE * 8)) ||
+        !txn_get_block(sb, txn, 0)) {
+        return -1;
+    }
+    bitmap_alloc_take(sb, txn, &data_alloc, bit, n);
+    uint32_t spare_block = 0;
+    if (inode_extents_need_block(inode, ext, next)) {
+        int64_t spare = bitmap_alloc_find(sb, txn, &data_alloc, 1);
+        if (spare < 0 || !txn_get_block(sb, txn, data_alloc.first_block + (uint32_t)spare / (BLOCK_SIZE * 8))) {
+            fprintf(stderr, "Error: No free data blocks for extent block\n");
+            return -1;
+        }
+        bitmap_alloc_take(sb, txn, &data_alloc, (uint32_t)spare, 1);
+        spare_block = sb->data_start + (uint32_t)spare;
+        if (!txn_get_block(sb, txn, spare_block)) return -1;
+    }
+    return inode_set_extents(sb, txn, inode, ext, next, spare_block);
+}
+
+int do_write(const struct superblock *sb, const char *filename) {
+    if (free_counts_enable(sb) < 0) {
         return -1;
     }
-    printf("    - Inode bitmap (block %u)\n", sb->inode_bitmap);
+    static struct transaction txn;
+    txn_begin(&txn);
     
-    // Append DATA record for inode block
-    if (append_data_record(sb, &jh, inode_block_num, inode_block) < 0) {
+    pthread_mutex_lock(&root_dir_lock);
+    uint32_t inum;
+    int64_t found = dir_index_load(sb, &root_index) < 0 ? -2 : dir_index_lookup(&root_index, filename, &inum);
+    pthread_mutex_unlock(&root_dir_lock);
+    if (found == -2) {
         return -1;
     }
-    printf("    - Inode block (block %u)\n", inode_block_num);
+    if (found < 0) {
+        int new_inum, slot;
+        if (create_in_txn(sb, &txn, filename, &new_inum, &slot) < 0) {
+            txn_release(&txn);
+            return -1;
+        }
+        inum = (uint32_t)new_inum;
+    }
     
-    // Append DATA record for directory block
-    if (append_data_record(sb, &jh, root_data_block, new_dir_block) < 0) {
+    txn_hold(&txn, &data_alloc.lock);
+    txn_hold(&txn, inode_lock(inum));
+    struct inode *inode = txn_get_inode(sb, &txn, inum);
+    if (!inode) {
+        txn_release(&txn);
+        return -1;
+    }
+    if (inode->type != 1) {
+        fprintf(stderr, "Error: '%s' is not a regular file\n", filename);
+        txn_release(&txn);
+        return -1;
+    }
+    if (inode->size != 0) {
+        fprintf(stderr, "Error: '%s' already has data\n", filename);
+        txn_release(&txn);
         return -1;
     }
-    printf("    - Directory block (block %u)\n", root_data_block);
     
-    // Append COMMIT record
-    if (append_commit_record(sb, &jh) < 0) {
+    uint8_t *buf = aligned_alloc(BLOCK_SIZE, STREAM_BATCH_BLOCKS * BLOCK_SIZE);
+    if (!buf) {
+        fprintf(stderr, "Error: Out of memory for write buffer\n");
+        txn_release(&txn);
         return -1;
     }
-    printf("    - Commit record\n");
     
-    printf("  Journal transaction complete (bytes used: %u)\n", jh.nbytes_used);
-    printf("File '%s' created successfully (pending install)\n", filename);
+    uint64_t total = 0;
+    uint32_t runs = 0;
+    int transactions = 0;
+    int result = 0;
+    size_t got;
+    while (result == 0 && (got = read_full(STDIN_FILENO, buf, STREAM_BATCH_BLOCKS * BLOCK_SIZE)) > 0) {
+        if (total + got > UINT32_MAX) {
+            fprintf(stderr, "Error: File exceeds %u bytes\n", UINT32_MAX);
+            result = -1;
+            break;
+        }
+        uint32_t nblocks = (uint32_t)((got + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        memset(buf + got, 0, (size_t)nblocks * BLOCK_SIZE - got);
+        
+        for (uint32_t done = 0; done < nblocks; ) {
+            // Each run can touch a data bitmap block and an extent block
+            if (txn.nblocks > TXN_MAX_BLOCKS - 3) {
+                inode->size = (uint32_t)total;
+                if (txn_commit(sb, &txn) < 0) {
+                    result = -1;
+                    break;
+                }
+                transactions++;
+                txn_begin(&txn);
+                txn_hold(&txn, &data_alloc.lock);
+                txn_hold(&txn, inode_lock(inum));
+                inode = txn_get_inode(sb, &txn, inum);
+                if (!inode) {
+                    result = -1;
+                    break;
+                }
+            }
+
+            // Largest free run that fits, halving the request on fragmented images
+            uint32_t want = nblocks - done;
+            int64_t bit = -1;
+            while (want > 0 && (bit = bitmap_alloc_find(sb, &txn, &data_alloc, want)) < 0) {
+                want /= 2;
+            }
+            if (bit < 0) {
+                fprintf(stderr, "Error: No free data blocks available\n");
+                result = -1;
+                break;
+            }
+            if (file_append_run(sb, &txn, inode, (uint32_t)bit, want) < 0) {
+                result = -1;
+                break;
+            }
+            txn_write_data(&txn, sb->data_start + (uint32_t)bit, buf + (size_t)done * BLOCK_SIZE, want);
+            size_t bytes = (size_t)want * BLOCK_SIZE;
+            if (bytes > got - (size_t)done * BLOCK_SIZE) bytes = got - (size_t)done * BLOCK_SIZE;
+            total += bytes;
+            done += want;
+            runs++;
+        }
+    }
+    free(buf);
+    
+    if (result == 0) {
+        inode->size = (uint32_t)total;
+        inode->mtime = (uint32_t)time(NULL);
+        if (txn_commit(sb, &txn) < 0) {
+            result = -1;
+        } else {
+            transactions++;
+        }
+    }
+    if (result < 0) {
+        txn_release(&txn);
+        return -1;
+    }
     
+    printf("Wrote %llu bytes to '%s' (inode %u) in %u run(s), %d transaction(s) (pending install)\n",
+           (unsigned long long)total, filename, inum, runs, transactions);
     return 0;
 }
 
+// Copies len bytes of the image at off to out, without a user-space copy where possible
+int stream_out(int out, off_t off, size_t len) {
+    if (disk_map) {
+        const uint8_t *src = map_blocks((uint32_t)(off / BLOCK_SIZE), len + off % BLOCK_SIZE, "read");
+        src += off % BLOCK_SIZE;
+        stats_io(0, len, 0, 0);
+        while (len > 0) {
+            ssize_t n = write(out, src, len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return -1;
+            src += n;
+            len -= (size_t)n;
+        }
+        return 0;
+    }
+    while (len > 0) {
+        uint64_t start = stats_clock();
+        ssize_t n = sendfile(out, disk_fd, &off, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) break;
+        if (n <= 0) return -1;
+        stats_io(0, (uint64_t)n, 1, start);
+        len -= (size_t)n;
+    }
+    // sendfile refused this descriptor: fall back to big buffered copies
+    static uint8_t buf[STREAM_BATCH_BLOCKS * BLOCK_SIZE];
+    while (len > 0) {
+        size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+        uint64_t start = stats_clock();
+        ssize_t n = pread(disk_fd, buf, chunk, off);
+        if (n <= 0) return -1;
+        stats_io(0, (uint64_t)n, 1, start);
+        for (ssize_t w = 0; w < n; ) {
+            ssize_t m = write(out, buf + w, (size_t)(n - w));
+            if (m < 0 && errno == EINTR) continue;
+            if (m <= 0) return -1;
+            w += m;
+        }
+        off += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
 
-/* ===================== INSTALL Command Implementation ===================== */
-
-int do_install(const struct superblock *sb) {
-    printf("Installing journal transactions...\n");
+int do_read(const struct superblock *sb, const char *filename) {
+    pthread_mutex_lock(&root_dir_lock);
+    uint32_t inum;
+    int64_t found = dir_index_load(sb, &root_index) < 0 ? -2 : dir_index_lookup(&root_index, filename, &inum);
+    pthread_mutex_unlock(&root_dir_lock);
+    if (found == -2) {
+        return -1;
+    }
+    if (found < 0) {
+        fprintf(stderr, "Error: File '%s' not found\n", filename);
+        return -1;
+    }
+    struct inode inode;
+    read_inode(sb, inum, &inode);
+    if (inode.type != 1) {
+        fprintf(stderr, "Error: '%s' is not a regular file\n", filename);
+        return -1;
+    }
     
-    struct journal_header jh;
-    read_journal_header(sb, &jh);
+    static struct extent ext[INODE_MAX_EXTENTS];
+    int next = inode_get_extents(sb, NULL, &inode, ext);
+    uint64_t left = inode.size;
     
-    if (jh.magic != JOURNAL_MAGIC) {
-        fprintf(stderr, "Error: Invalid journal magic\n");
+    // Start readahead on every extent up front; they are read in order
+    if (!disk_map) {
+        uint64_t ahead = left;
+        for (int i = 0; i < next && ahead > 0; i++) {
+            uint64_t len = (uint64_t)ext[i].length * BLOCK_SIZE;
+            if (len > ahead) len = ahead;
+            posix_fadvise(disk_fd, (off_t)ext[i].start * BLOCK_SIZE, (off_t)len, POSIX_FADV_WILLNEED);
+            ahead -= len;
+        }
+    }
+    for (int i = 0; i < next && left > 0; i++) {
+        uint64_t len = (uint64_t)ext[i].length * BLOCK_SIZE;
+        if (len > left) len = left;
+        if (stream_out(STDOUT_FILENO, (off_t)ext[i].start * BLOCK_SIZE, (size_t)len) < 0) {
+            fprintf(stderr, "Error: Writing '%s' to output failed: %s\n", filename, strerror(errno));
+            return -1;
+        }
+        left -= len;
+    }
+    if (left > 0) {
+        fprintf(stderr, "Error: '%s' is shorter on disk than its size\n", filename);
         return -1;
     }
+    return 0;
+}
+
+
+/* ===================== INSTALL Command Implementation ===================== */
+
+#define INSTALL_RUN_BLOCKS 256     // blocks per write request, well under IOV_MAX
+
+int overlay_entry_cmp(const void *a, const void *b) {
+    uint32_t x = (*(struct overlay_entry *const *)a)->block_no;
+    uint32_t y = (*(struct overlay_entry *const *)b)->block_no;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Checkpoints the log. Every block is written once, with its final image
+ * from the overlay, no matter how many records touch it. Blocks go out in
+ * ascending order, and neighbours are merged into a single write. One
+ * fdatasync makes the home copies durable before the header is cleared,
+ * so a crash at any point leaves either the old log or the new home
+ * blocks. Replaying the old log is harmless. Called with journal_mutex
+ * held; queued transactions are made durable first.
+ */
+int journal_install_locked(const struct superblock *sb, FILE *out) {
+    fprintf(out, "Installing journal transactions...\n");
     
-    if (jh.nbytes_used <= sizeof(struct journal_header)) {
-        printf("Journal is empty, nothing to install.\n");
-        return 0;
+    // Transactions may queue while a group write runs, and another
+    // checkpoint may finish while this one waits; all must be durable
+    for (;;) {
+        if (overlay_load(sb) < 0) {
+            fprintf(stderr, "Error: Invalid journal magic\n");
+            return -1;
+        }
+        if (group.flushing) {
+            pthread_cond_wait(&journal_durable, &journal_mutex);
+        } else if (group.durable_seq != overlay.jh.tail_seq) {
+            journal_write_pending(sb);
+        } else {
+            break;
+        }
     }
+    struct journal_header jh = overlay.jh;
     
-    // Read entire journal block
-    uint8_t journal_buf[BLOCK_SIZE];
-    read_block_raw(sb->journal_block, journal_buf);
+    if (jh.nbytes_used == 0) {
+        fprintf(out, "Journal is empty, nothing to install.\n");
+        log_emptied = 1;
+        return 0;
+    }
     
-    uint32_t offset = sizeof(struct journal_header);
+    uint32_t capacity = journal_capacity(sb);
+    const struct rec_header *hdr;
     int data_records = 0;
-    int commit_found = 0;
+    int delta_records = 0;
+    int transactions = 0;
+    int pending = 0;
     
-    // First pass: validate and count records
-    uint32_t temp_offset = offset;
-    while (temp_offset < jh.nbytes_used) {
-        struct rec_header *hdr = (struct rec_header *)(journal_buf + temp_offset);
-        
-        if (hdr->type == REC_DATA) {
-            data_records++;
-            temp_offset += sizeof(struct data_record);
+    // Validate and count records
+    uint32_t pos = jh.head;
+    uint32_t remaining = jh.nbytes_used;
+    int rc;
+    while ((rc = journal_next_record(overlay.log, capacity, &pos, &remaining, &hdr)) > 0) {
+        if (hdr->type == REC_DATA || hdr->type == REC_DELTA) {
+            if (!journal_record_valid(hdr)) {
+                fprintf(stderr, "Error: Corrupt record of type %d\n", hdr->type);
+                return -1;
+            }
+            if (hdr->type == REC_DATA) data_records++;
+            else delta_records++;
+            pending = 1;
         } else if (hdr->type == REC_COMMIT) {
-            commit_found = 1;
-            break;
+            transactions++;
+            pending = 0;
         } else {
             fprintf(stderr, "Error: Unknown record type %d\n", hdr->type);
             return -1;
         }
     }
     
-    if (!commit_found) {
-        printf("No commit record found, transaction incomplete. Aborting.\n");
+    if (rc < 0) {
+        fprintf(stderr, "Error: Malformed journal log\n");
+        return -1;
+    }
+    
+    if (pending) {
+        fprintf(out, "No commit record found, transaction incomplete. Aborting.\n");
         return -1;
     }
     
-    printf("  Found %d data records with commit\n", data_records);
+    fprintf(out, "  Found %d data records and %d delta records in %d committed transaction(s)\n",
+            data_records, delta_records, transactions);
     
-    // Second pass: replay DATA records
-    while (offset < jh.nbytes_used) {
-        struct rec_header *hdr = (struct rec_header *)(journal_buf + offset);
-        
-        if (hdr->type == REC_DATA) {
-            struct data_record *rec = (struct data_record *)(journal_buf + offset);
-            printf("  Applying block %u...\n", rec->block_no);
-            write_block_raw(rec->block_no, rec->data);
-            offset += sizeof(struct data_record);
-        } else if (hdr->type == REC_COMMIT) {
-            printf("  Commit record reached\n");
-            break;
+    // Final image of each dirty block, in block order
+    struct overlay_entry **dirty = malloc((overlay.nentries + 1) * sizeof(*dirty));
+    struct iovec *iov = malloc((overlay.nentries + 1) * sizeof(*iov));
+    if (!dirty || !iov) {
+        fprintf(stderr, "do_install: out of memory\n");
+        exit(1);
+    }
+    uint32_t ndirty = 0;
+    for (uint32_t i = 0; i < overlay.capacity; i++) {
+        if (overlay.table[i].used && overlay.table[i].nrecs > 0) {
+            dirty[ndirty++] = &overlay.table[i];
         }
     }
+    qsort(dirty, ndirty, sizeof(*dirty), overlay_entry_cmp);
+    overlay_images_load(dirty, ndirty);
     
-    // Clear journal (checkpoint)
-    jh.nbytes_used = sizeof(struct journal_header);
-    memset(journal_buf + sizeof(struct journal_header), 0, 
-           BLOCK_SIZE - sizeof(struct journal_header));
-    memcpy(journal_buf, &jh, sizeof(struct journal_header));
-    write_block_raw(sb->journal_block, journal_buf);
+    uint32_t runs = 0;
+    for (uint32_t i = 0; i < ndirty; ) {
+        uint32_t first = dirty[i]->block_no;
+        struct iovec *run = &iov[i];
+        int n = 0;
+        while (i < ndirty && n < INSTALL_RUN_BLOCKS && dirty[i]->block_no == first + (uint32_t)n) {
+            iov[i].iov_base = (void *)overlay_image(dirty[i]);
+            iov[i].iov_len = BLOCK_SIZE;
+            n++;
+            i++;
+        }
+        write_blocks_queue(first, run, n);
+        runs++;
+    }
+    
+    // Home blocks must be durable before the log forgets them; the runs
+    // and the flush go to the kernel together
+    sync_disk();
+    fprintf(out, "  Wrote %u unique block(s) in %u run(s)\n", ndirty, runs);
+    free(iov);
+    free(dirty);
+    
+    // Clear journal (checkpoint): everything up to the tail is now home
+    jh.head = jh.tail;
+    jh.head_seq = jh.tail_seq;
+    jh.nbytes_used = 0;
+    write_journal_header(sb, &jh);
+    if (sync_mode == SYNC_FULL) {
+        sync_disk();
+    } else {
+        bcache_flush();
+    }
+    overlay_reset();
+    log_emptied = 1;
     
-    printf("Journal installed and cleared successfully.\n");
+    fprintf(out, "Journal installed and cleared successfully.\n");
+    return 0;
+}
+
+int journal_checkpoint_locked(const struct superblock *sb, FILE *out) {
+    struct phase_timer timer;
+    phase_begin(&timer, PHASE_INSTALL);
+    int result = journal_install_locked(sb, out);
+    phase_end(&timer);
+    return result;
+}
+
+int do_install(const struct superblock *sb) {
+    pthread_mutex_lock(&journal_mutex);
+    int result = journal_checkpoint_locked(sb, stdout);
+    pthread_mutex_unlock(&journal_mutex);
+    return result;
+}
+
+// Marks the image clean once the checkpoint that emptied the log is durable
+void journal_mark_clean(void) {
+    sync_disk();
+    write_superblock_state(FS_STATE_CLEAN);
+    if (sync_mode == SYNC_FULL) {
+        sync_disk();
+    } else {
+        bcache_flush();
+    }
+}
+
+/*
+ * Runs at open. An image not marked clean may hold committed transactions,
+ * left by an earlier run or by a crash; replay the log into the overlay so
+ * the command sees them. They go home at the high-water mark or on install.
+ */
+int journal_recover(const struct superblock *sb) {
+    if (fs_clean) return 0;
+    pthread_mutex_lock(&journal_mutex);
+    int result = overlay_load(sb);
+    pthread_mutex_unlock(&journal_mutex);
+    if (result < 0) {
+        fprintf(stderr, "Error: Invalid journal magic\n");
+        return -1;
+    }
     return 0;
 }
 
+// Runs at exit: committed records stay in the log for later runs, and only
+// an image whose log a checkpoint in this run emptied is marked clean, so
+// read-only commands never write. Reads after the checkpoint may reload the
+// overlay, but only a commit puts records back
+void journal_shutdown(void) {
+    if (fs_clean) return;
+    pthread_mutex_lock(&journal_mutex);
+    int empty = log_emptied && (!overlay.loaded || (overlay.valid && overlay.jh.nbytes_used == 0));
+    pthread_mutex_unlock(&journal_mutex);
+    if (empty) journal_mark_clean();
+}
+
 
 /* ===================== Main Function ===================== */
 
+// Writes the --stats report: device counters, cache, commits and phases
+void stats_dump(FILE *out, const char *command, double elapsed) {
+    fprintf(out, "{\"command\": \"%s\", \"io\": \"%s\", \"sync\": \"%s\", \"elapsed_ms\": %.3f,\n",
+            command, disk_use_mmap ? "mmap" : disk_use_uring ? "uring" : "sync", sync_mode_names[sync_mode], elapsed);
+    fprintf(out, " \"device\": {\"blocks_read\": %llu, \"blocks_written\": %llu, "
+            "\"bytes_read\": %llu, \"bytes_written\": %llu, \"read_calls\": %llu, \"write_calls\": %llu, "
+            "\"flushes\": %llu, \"ring_enters\": %llu, \"device_ms\": %.3f},\n",
+            (unsigned long long)io_stats.blocks_read, (unsigned long long)io_stats.blocks_written,
+            (unsigned long long)io_stats.bytes_read, (unsigned long long)io_stats.bytes_written,
+            (unsigned long long)io_stats.read_calls, (unsigned long long)io_stats.write_calls,
+            (unsigned long long)io_stats.flushes, (unsigned long long)io_stats.ring_enters,
+            io_stats.device_ns / 1e6);
+    fprintf(out, " \"cache\": {\"hits\": %llu, \"misses\": %llu, \"writebacks\": %llu, "
+            "\"inode_hits\": %llu, \"inode_misses\": %llu},\n",
+            (unsigned long long)bcache.hits, (unsigned long long)bcache.misses,
+            (unsigned long long)bcache.writebacks, (unsigned long long)icache.hits,
+            (unsigned long long)icache.misses);
+    fprintf(out, " \"commits\": {\"count\": %u, \"journal_writes\": %llu, \"avg_ms\": %.3f, \"max_ms\": %.3f},\n",
+            commit_latency.commits, (unsigned long long)group.writes,
+            commit_latency.commits ? commit_latency.total_ms / commit_latency.commits : 0.0,
+            commit_latency.max_ms);
+    fprintf(out, " \"phases\": {");
+    for (int p = 0; p < NPHASES; p++) {
+        fprintf(out, "%s\"%s\": {\"count\": %llu, \"ms\": %.3f, \"device_ms\": %.3f}",
+                p ? ", " : "", stat_phase_names[p], (unsigned long long)io_stats.phase[p].count,
+                io_stats.phase[p].ns / 1e6, io_stats.phase[p].device_ns / 1e6);
+    }
+    fprintf(out, "}}\n");
+}
+
 int main(int argc, char *argv[]) {
+    const char *prog = argv[0];
+    int show_cache_stats = 0;
+    const char *stats_path = NULL;      // --stats with no path writes to stderr
+    
+    // Global options come before the command
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--cache-stats") == 0) {
+            show_cache_stats = 1;
+        } else if (strcmp(argv[1], "--stats") == 0 || strncmp(argv[1], "--stats=", 8) == 0) {
+            stats_enabled = 1;
+            stats_path = argv[1][7] == '=' ? argv[1] + 8 : NULL;
+        } else if (strcmp(argv[1], "--mmap") == 0) {
+            disk_use_mmap = 1;
+        } else if (strcmp(argv[1], "--io=sync") == 0 || strcmp(argv[1], "--io=uring") == 0) {
+            disk_use_uring = strcmp(argv[1] + 5, "uring") == 0;
+        } else if (strncmp(argv[1], "--sync=", 7) == 0) {
+            int m = SYNC_FULL;
+            while (m >= 0 && strcmp(argv[1] + 7, sync_mode_names[m]) != 0) m--;
+            if (m < 0) {
+                fprintf(stderr, "Unknown sync mode: %s (expected none, commit or full)\n", argv[1] + 7);
+                return 1;
+            }
+            sync_mode = m;
+        } else if (strncmp(argv[1], "--threads=", 10) == 0) {
+            char *end;
+            long n = strtol(argv[1] + 10, &end, 10);
+            if (end == argv[1] + 10 || *end != '\0' || n < 1 || n > 256) {
+                fprintf(stderr, "Invalid thread count: %s (expected 1-256)\n", argv[1] + 10);
+                return 1;
+            }
+            batch_threads = (int)n;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[1]);
+            return 1;
+        }
+        argv++;
+        argc--;
+    }
+    argv[0] = (char *)prog;
+    
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <command> [args...] [image-path]\n", argv[0]);
-        fprintf(stderr, "Commands: info | create <name> | install\n");
+        fprintf(stderr, "Usage: %s [--cache-stats] [--stats[=path]] [--mmap] [--io=sync|uring] [--sync=none|commit|full] [--threads=N] <command> [args...] [image-path]\n", argv[0]);
+        fprintf(stderr, "Commands: info | create <name> | create-batch <names-file|-> | write <name> | read <name> | install\n");
         return 1;
     }
 
     const char *image_path = "vsfs.img";
     
     // Determine image path based on command
-    if (strcmp(argv[1], "create") == 0) {
+    if (strcmp(argv[1], "create") == 0 || strcmp(argv[1], "create-batch") == 0 ||
+        strcmp(argv[1], "write") == 0 || strcmp(argv[1], "read") == 0) {
         if (argc >= 4) image_path = argv[3];
     } else {
         if (argc >= 3) image_path = argv[argc-1];
     }
 
+    struct timespec run_started;
+    clock_gettime(CLOCK_MONOTONIC, &run_started);
     open_disk(image_path);
 
     struct superblock sb;
@@ -520,6 +3583,22 @@ int main(int argc, char *argv[]) {
         close_disk();
         return 1;
     }
+    if (sb.inode_bitmap < sb.journal_block + 2 || sb.inode_bitmap - sb.journal_block > MAX_JOURNAL_BLOCKS) {
+        fprintf(stderr, "Error: Journal region %u..%u must be 2 to %u blocks\n",
+                sb.journal_block, sb.inode_bitmap, MAX_JOURNAL_BLOCKS);
+        close_disk();
+        return 1;
+    }
+
+    fs_clean = sb.state == FS_STATE_CLEAN;
+    if (!fs_clean) {
+        format_journal_if_blank(&sb);
+        if (journal_recover(&sb) < 0) {
+            close_disk();
+            return 1;
+        }
+    }
+    bitmap_alloc_init(&sb);
 
     int result = 0;
 
@@ -535,31 +3614,64 @@ int main(int argc, char *argv[]) {
         printf("  Inode Start Block: %u\n", sb.inode_start);
         printf("  Data Start Block: %u\n", sb.data_start);
         
-        // Additional Phase 2 info
+        // Recovery has already scanned a dirty log; a clean one only needs its header
+        pthread_mutex_lock(&journal_mutex);
+        overlay_load(&sb);
+        struct journal_header jh = overlay.jh;
+        pthread_mutex_unlock(&journal_mutex);
+        printf("\nJournal:\n");
+        printf("  Log Capacity: %u bytes (%u blocks)\n",
+               journal_capacity(&sb), journal_capacity(&sb) / BLOCK_SIZE);
+        printf("  Bytes Used: %u (head %u, tail %u)\n", jh.nbytes_used, jh.head, jh.tail);
+        printf("  Transactions: %u pending (sequence %u..%u)\n",
+               jh.tail_seq - jh.head_seq, jh.head_seq, jh.tail_seq);
+        
+        // Capacity comes from the superblock counters, not a bitmap scan,
+        // unless the image predates them
         printf("\nBitmap Analysis:\n");
-        uint8_t inode_bitmap[BLOCK_SIZE];
-        read_bitmap_block(sb.inode_bitmap, inode_bitmap);
-        int used_inodes = 0;
-        for (uint32_t i = 0; i < sb.inode_count; i++) {
-            if (check_bit(inode_bitmap, i)) used_inodes++;
+        uint8_t super[BLOCK_SIZE];
+        read_fs_block(&sb, 0, super);
+        const struct superblock *counts = (const struct superblock *)super;
+        uint32_t free_inodes = counts->free_inodes;
+        uint32_t free_blocks = counts->free_blocks;
+        if (!(counts->features & FS_FEATURE_FREE_COUNTS)) {
+            free_inodes = (uint32_t)bitmap_alloc_free(&sb, &inode_alloc);
+            free_blocks = (uint32_t)bitmap_alloc_free(&sb, &data_alloc);
         }
-        printf("  Used Inodes: %d / %u\n", used_inodes, sb.inode_count);
+        printf("  Used Inodes: %u / %u\n", inode_alloc.nbits - free_inodes, inode_alloc.nbits);
+        printf("  Used Data Blocks: %u / %u\n", data_alloc.nbits - free_blocks, data_alloc.nbits);
         
-        int free_inode = find_free_inode(&sb, inode_bitmap);
-        printf("  First Free Inode: %d\n", free_inode);
+        // Stops at the first bitmap block with a free bit
+        int64_t free_inode = -1;
+        uint8_t bitmap[BLOCK_SIZE];
+        for (uint32_t b = 0; free_inode < 0 && free_inodes > 0 && b < inode_alloc.nblocks; b++) {
+            read_bitmap_block(&sb, inode_alloc.first_block + b, bitmap);
+            int bit = bitmap_find(bitmap, 0, bitmap_alloc_block_bits(&inode_alloc, b), 0);
+            if (bit >= 0) free_inode = (int64_t)b * BLOCK_SIZE * 8 + bit;
+        }
+        printf("  First Free Inode: %lld\n", (long long)free_inode);
         
         // Show root directory contents
         printf("\nRoot Directory Contents:\n");
         struct inode root_inode;
         read_inode(&sb, 0, &root_inode);
-        if (root_inode.type == 2 && root_inode.direct[0] != 0) {
-            uint8_t dir_block[BLOCK_SIZE];
-            read_block_raw(root_inode.direct[0], dir_block);
-            struct dirent *entries = (struct dirent *)dir_block;
-            for (int i = 0; i < DIRENTS_PER_BLOCK; i++) {
-                if (entries[i].inode != 0) {
-                    printf("  [%d] inode=%u name='%s'\n", i, entries[i].inode, entries[i].name);
+        uint32_t nentries = root_inode.type == 2 ? root_inode.size / sizeof(struct dirent) : 0;
+        static struct extent ext[INODE_MAX_EXTENTS];
+        int next = inode_get_extents(&sb, NULL, &root_inode, ext);
+        uint8_t dir_block[BLOCK_SIZE];
+        struct dirent *entries = (struct dirent *)dir_block;
+        for (uint32_t pos = 0; pos < nentries; pos++) {
+            if (pos % DIRENTS_PER_BLOCK == 0) {
+                uint32_t block_num = extent_lookup(ext, next, pos / DIRENTS_PER_BLOCK);
+                if (block_num == 0) {
+                    pos += DIRENTS_PER_BLOCK - 1;
+                    continue;
                 }
+                read_fs_block(&sb, block_num, dir_block);
+            }
+            struct dirent *de = &entries[pos % DIRENTS_PER_BLOCK];
+            if (de->name[0] != '\0') {
+                printf("  [%u] inode=%u name='%s'\n", pos, de->inode, de->name);
             }
         }
         
@@ -571,6 +3683,22 @@ int main(int argc, char *argv[]) {
         }
         result = do_create(&sb, argv[2]);
         
+    } else if (strcmp(argv[1], "create-batch") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Usage: %s create-batch <names-file|-> [image-path]\n", argv[0]);
+            close_disk();
+            return 1;
+        }
+        result = do_create_batch(&sb, argv[2]);
+        
+    } else if (strcmp(argv[1], "write") == 0 || strcmp(argv[1], "read") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "Usage: %s %s <filename> [image-path]\n", argv[0], argv[1]);
+            close_disk();
+            return 1;
+        }
+        result = argv[1][0] == 'w' ? do_write(&sb, argv[2]) : do_read(&sb, argv[2]);
+        
     } else if (strcmp(argv[1], "install") == 0) {
         result = do_install(&sb);
         
@@ -579,6 +3707,32 @@ int main(int argc, char *argv[]) {
         result = 1;
     }
 
+    journal_shutdown();
     close_disk();
+    
+    if (commit_latency.commits > 0) {
+        printf("Commit latency (--sync=%s): %u commit(s) in %llu journal write(s), avg %.3f ms, max %.3f ms\n",
+               sync_mode_names[sync_mode], commit_latency.commits, (unsigned long long)group.writes,
+               commit_latency.total_ms / commit_latency.commits, commit_latency.max_ms);
+    }
+    
+    if (show_cache_stats) {
+        uint64_t lookups = bcache.hits + bcache.misses;
+        printf("Block cache: %llu hits, %llu misses (%.1f%% hit rate), %llu write-backs\n",
+               (unsigned long long)bcache.hits, (unsigned long long)bcache.misses,
+               lookups ? 100.0 * (double)bcache.hits / (double)lookups : 0.0,
+               (unsigned long long)bcache.writebacks);
+        printf("Inode cache: %llu hits, %llu misses\n",
+               (unsigned long long)icache.hits, (unsigned long long)icache.misses);
+    }
+    if (stats_enabled) {
+        FILE *out = stats_path ? fopen(stats_path, "w") : stderr;
+        if (!out) {
+            fprintf(stderr, "Error: Cannot write stats to %s: %s\n", stats_path, strerror(errno));
+            return 1;
+        }
+        stats_dump(out, argv[1], elapsed_ms(&run_started));
+        if (out != stderr) fclose(out);
+    }
     return result;
 }
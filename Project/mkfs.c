@@ -4,24 +4,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
 #define FS_MAGIC 0x56534653U
+#define JOURNAL_MAGIC 0x4A524E4CU
+#define FS_STATE_CLEAN 0x434C4E53U  // superblock state: journal empty, home blocks current
+#define FS_FEATURE_FREE_COUNTS 0x1U // superblock free_inodes and free_blocks are kept
 
 #define BLOCK_SIZE        4096U
 #define INODE_SIZE         128U
+#define INODES_PER_BLOCK   (BLOCK_SIZE / INODE_SIZE)
+#define BITS_PER_BLOCK     (BLOCK_SIZE * 8U)
 #define JOURNAL_BLOCK_IDX    1U
-#define JOURNAL_BLOCKS      16U
-#define INODE_BLOCKS         2U
-#define DATA_BLOCKS         64U
-#define INODE_BMAP_IDX     (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
-#define DATA_BMAP_IDX      (INODE_BMAP_IDX + 1U)
-#define INODE_START_IDX    (DATA_BMAP_IDX + 1U)
-#define DATA_START_IDX     (INODE_START_IDX + INODE_BLOCKS)
-#define TOTAL_BLOCKS       (DATA_START_IDX + DATA_BLOCKS)
+
+// Defaults reproduce the original fixed layout: 16 journal blocks, 2 inode
+// blocks and 64 data blocks, 85 blocks in all
+#define DEFAULT_JOURNAL_BLOCKS 16U
+#define DEFAULT_INODE_COUNT    64U
+#define DEFAULT_TOTAL_BLOCKS   85U
+// Header plus a log of at most 2 GiB, so jnrl's 32-bit log offsets cannot wrap
+#define MAX_JOURNAL_BLOCKS     (1U + (1U << 31) / BLOCK_SIZE)
+#define BYTES_PER_INODE    16384U   // inode density when only -s is given
 #define DEFAULT_IMAGE "vsfs.img"
 
+// --sync: none leaves the image in the page cache, commit flushes it before
+// exiting, full also writes the superblock only after everything else is
+// durable and flushes the directory entry of a new image
+#define SYNC_NONE   0
+#define SYNC_COMMIT 1
+#define SYNC_FULL   2
+
 struct superblock {
     uint32_t magic;
     uint32_t block_size;
@@ -34,7 +49,12 @@ struct superblock {
     uint32_t inode_start;
     uint32_t data_start;
 
-    uint8_t  _pad[128 - 9 * 4];
+    uint32_t state;   // FS_STATE_CLEAN, anything else means the journal may hold work
+    uint32_t features;
+    uint32_t free_inodes;
+    uint32_t free_blocks;
+
+    uint8_t  _pad[128 - 13 * 4];
 };
 
 struct inode {
@@ -64,11 +84,121 @@ static void die(const char *msg) {
     exit(EXIT_FAILURE);
 }
 
-static void write_block(int fd, const void *block) {
-    ssize_t written = write(fd, block, BLOCK_SIZE);
-    if (written != (ssize_t)BLOCK_SIZE) {
-        die("write");
+/* The image is sized with ftruncate up front, so every block mkfs does not
+ * write is a hole that reads back as zeros. Only the handful of metadata
+ * blocks with content are written, batched into one pwritev per run of
+ * adjacent blocks, or copied into a shared mapping with --mmap. */
+static uint8_t *image_map = NULL;
+
+#define MAX_BATCH 16
+
+static struct iovec batch[MAX_BATCH];
+static uint32_t batch_first = 0;
+static int batch_count = 0;
+
+static void flush_blocks(int fd) {
+    if (batch_count == 0) {
+        return;
+    }
+    ssize_t written = pwritev(fd, batch, batch_count, (off_t)batch_first * BLOCK_SIZE);
+    if (written != (ssize_t)batch_count * (ssize_t)BLOCK_SIZE) {
+        die("pwritev");
+    }
+    batch_count = 0;
+}
+
+// block must stay valid until the next flush_blocks()
+static void write_block(int fd, uint32_t block_index, const void *block) {
+    if (image_map) {
+        memcpy(image_map + (size_t)block_index * BLOCK_SIZE, block, BLOCK_SIZE);
+        return;
+    }
+    if (batch_count > 0 &&
+        (block_index != batch_first + (uint32_t)batch_count || batch_count == MAX_BATCH)) {
+        flush_blocks(fd);
     }
+    if (batch_count == 0) {
+        batch_first = block_index;
+    }
+    batch[batch_count].iov_base = (void *)block;
+    batch[batch_count].iov_len = BLOCK_SIZE;
+    batch_count++;
+}
+
+// Parses a byte count with an optional K, M, G or T suffix (powers of 1024)
+static int parse_size(const char *text, uint64_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text) {
+        return -1;
+    }
+    unsigned shift = 0;
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    case 't': case 'T': shift = 40; end++; break;
+    default: break;
+    }
+    if (*end != '\0' || value > (UINT64_MAX >> shift)) {
+        return -1;
+    }
+    *out = (uint64_t)value << shift;
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--mmap] [--sync=none|commit|full] [-s size[K|M|G|T]] [-i inodes] [-J journal-blocks] [image]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static int parse_sync_mode(const char *text) {
+    static const char *const names[] = { "none", "commit", "full" };
+    for (int m = SYNC_NONE; m <= SYNC_FULL; m++) {
+        if (strcmp(text, names[m]) == 0) {
+            return m;
+        }
+    }
+    return -1;
+}
+
+static void sync_image(int fd, size_t image_size, int sync_mode) {
+    if (sync_mode == SYNC_NONE) {
+        return;
+    }
+    if (image_map) {
+        if (msync(image_map, image_size, MS_SYNC) < 0) {
+            die("msync");
+        }
+    } else if (fdatasync(fd) < 0) {
+        die("fdatasync");
+    }
+}
+
+// Makes the image's name durable in its parent directory
+static void sync_parent_dir(const char *image_path) {
+    const char *slash = strrchr(image_path, '/');
+    char dir[4096] = ".";
+    if (slash) {
+        size_t len = (size_t)(slash - image_path);
+        if (len == 0) {
+            len = 1;    // image in /
+        }
+        if (len >= sizeof(dir)) {
+            return;
+        }
+        memcpy(dir, image_path, len);
+        dir[len] = '\0';
+    }
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dfd < 0) {
+        die("open parent directory");
+    }
+    if (fsync(dfd) < 0) {
+        die("fsync parent directory");
+    }
+    close(dfd);
 }
 
 static void set_bitmap(uint8_t *bitmap, uint32_t index) {
@@ -76,43 +206,142 @@ static void set_bitmap(uint8_t *bitmap, uint32_t index) {
 }
 
 int main(int argc, char *argv[]) {
+    const char *prog = argv[0];
+    int use_mmap = 0;
+    int sync_mode = SYNC_COMMIT;
+    uint64_t image_bytes = (uint64_t)DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE;
+    uint64_t inode_count = 0;
+    uint64_t journal_blocks = DEFAULT_JOURNAL_BLOCKS;
+    int size_given = 0;
+
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "--mmap") == 0) {
+            use_mmap = 1;
+        } else if (strncmp(argv[1], "--sync=", 7) == 0) {
+            sync_mode = parse_sync_mode(argv[1] + 7);
+            if (sync_mode < 0) {
+                fprintf(stderr, "invalid sync mode '%s' (expected none, commit or full)\n", argv[1] + 7);
+                return EXIT_FAILURE;
+            }
+        } else if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+            if (parse_size(argv[2], &image_bytes) < 0) {
+                fprintf(stderr, "invalid image size '%s'\n", argv[2]);
+                return EXIT_FAILURE;
+            }
+            size_given = 1;
+            argv++;
+            argc--;
+        } else if (argc > 2 && strcmp(argv[1], "-i") == 0) {
+            if (parse_size(argv[2], &inode_count) < 0 || inode_count == 0) {
+                fprintf(stderr, "invalid inode count '%s'\n", argv[2]);
+                return EXIT_FAILURE;
+            }
+            argv++;
+            argc--;
+        } else if (argc > 2 && strcmp(argv[1], "-J") == 0) {
+            if (parse_size(argv[2], &journal_blocks) < 0 || journal_blocks < 2 ||
+                journal_blocks > MAX_JOURNAL_BLOCKS) {
+                fprintf(stderr, "invalid journal size '%s' (need 2 to %u blocks)\n", argv[2], MAX_JOURNAL_BLOCKS);
+                return EXIT_FAILURE;
+            }
+            argv++;
+            argc--;
+        } else {
+            usage(prog);
+        }
+        argv++;
+        argc--;
+    }
+    if (argc > 2) {
+        usage(prog);
+    }
     const char *image_path = (argc > 1) ? argv[1] : DEFAULT_IMAGE;
 
-    int fd = open(image_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
-    if (fd < 0) {
-        die("open");
+    // ===== Layout =====
+    // superblock | journal | inode bitmap | data bitmap | inodes | data
+    uint64_t total_blocks = image_bytes / BLOCK_SIZE;
+    if (total_blocks > UINT32_MAX) {
+        fprintf(stderr, "image of %llu blocks is too large (max %u)\n",
+                (unsigned long long)total_blocks, UINT32_MAX);
+        return EXIT_FAILURE;
+    }
+    if (inode_count == 0) {
+        inode_count = size_given ? image_bytes / BYTES_PER_INODE : DEFAULT_INODE_COUNT;
+    }
+    // Fill the last inode block; a partial one would only waste space
+    uint64_t inode_blocks = (inode_count + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    inode_count = inode_blocks * INODES_PER_BLOCK;
+    if (inode_count > UINT32_MAX) {
+        fprintf(stderr, "too many inodes (max %u)\n", UINT32_MAX);
+        return EXIT_FAILURE;
     }
+    uint64_t inode_bitmap_blocks = (inode_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
 
-    uint8_t block[BLOCK_SIZE];
-    memset(block, 0, sizeof(block));
+    uint64_t fixed_blocks = JOURNAL_BLOCK_IDX + journal_blocks + inode_bitmap_blocks + inode_blocks;
+    if (total_blocks < fixed_blocks + 2) {
+        fprintf(stderr, "image of %llu blocks is too small: metadata alone needs %llu\n",
+                (unsigned long long)total_blocks, (unsigned long long)fixed_blocks + 2);
+        return EXIT_FAILURE;
+    }
+    // The data bitmap covers whatever is left after itself
+    uint64_t remaining = total_blocks - fixed_blocks;
+    uint64_t data_bitmap_blocks = (remaining + BITS_PER_BLOCK) / (BITS_PER_BLOCK + 1);
+    uint64_t data_blocks = remaining - data_bitmap_blocks;
 
     struct superblock sb = {
         .magic = FS_MAGIC,
         .block_size = BLOCK_SIZE,
-        .total_blocks = TOTAL_BLOCKS,
-        .inode_count = INODE_BLOCKS * (BLOCK_SIZE / INODE_SIZE),
+        .total_blocks = (uint32_t)total_blocks,
+        .inode_count = (uint32_t)inode_count,
         .journal_block = JOURNAL_BLOCK_IDX,
-        .inode_bitmap = INODE_BMAP_IDX,
-        .data_bitmap = DATA_BMAP_IDX,
-        .inode_start = INODE_START_IDX,
-        .data_start = DATA_START_IDX,
+        .state = FS_STATE_CLEAN,
     };
+    sb.inode_bitmap = sb.journal_block + (uint32_t)journal_blocks;
+    sb.data_bitmap = sb.inode_bitmap + (uint32_t)inode_bitmap_blocks;
+    sb.inode_start = sb.data_bitmap + (uint32_t)data_bitmap_blocks;
+    sb.data_start = sb.inode_start + (uint32_t)inode_blocks;
+    sb.features = FS_FEATURE_FREE_COUNTS;
+    sb.free_inodes = sb.inode_count - 1;                  // root
+    sb.free_blocks = sb.total_blocks - sb.data_start - 1; // root directory block
 
-    memcpy(block, &sb, sizeof(sb));
-    write_block(fd, block); // Superblock
+    // ===== Image =====
+    int fd = open(image_path, O_CREAT | O_TRUNC | (use_mmap ? O_RDWR : O_WRONLY), 0644);
+    if (fd < 0) {
+        die("open");
+    }
 
-    memset(block, 0, sizeof(block));
-    for (uint32_t i = 0; i < JOURNAL_BLOCKS; ++i) {
-        write_block(fd, block); // Journal blocks
+    size_t image_size = (size_t)total_blocks * BLOCK_SIZE;
+    if (ftruncate(fd, (off_t)image_size) < 0) {
+        die("ftruncate");
     }
+    if (use_mmap) {
+        image_map = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (image_map == MAP_FAILED) {
+            die("mmap");
+        }
+    }
+
+    static uint8_t sb_block[BLOCK_SIZE];
+    static uint8_t journal_header[BLOCK_SIZE];
+    static uint8_t inode_bitmap[BLOCK_SIZE];
+    static uint8_t data_bitmap[BLOCK_SIZE];
+    static uint8_t inode_block[BLOCK_SIZE];
+    static uint8_t root_block[BLOCK_SIZE];
 
-    memset(block, 0, sizeof(block));
-    set_bitmap(block, 0); // Reserve inode 0 for root
-    write_block(fd, block); // Inode bitmap
+    memcpy(sb_block, &sb, sizeof(sb));
+    if (sync_mode != SYNC_FULL) {
+        write_block(fd, 0, sb_block); // Superblock
+    }
 
-    memset(block, 0, sizeof(block));
-    set_bitmap(block, 0); // Reserve first data block for root directory
-    write_block(fd, block); // Data bitmap
+    uint32_t journal_magic = JOURNAL_MAGIC;
+    memcpy(journal_header, &journal_magic, sizeof(journal_magic));
+    write_block(fd, sb.journal_block, journal_header); // Journal header: empty log, head = tail = 0
+
+    set_bitmap(inode_bitmap, 0); // Reserve inode 0 for root
+    write_block(fd, sb.inode_bitmap, inode_bitmap);
+
+    set_bitmap(data_bitmap, 0); // Reserve first data block for root directory
+    write_block(fd, sb.data_bitmap, data_bitmap);
 
     time_t now = time(NULL);
 
@@ -121,36 +350,46 @@ int main(int argc, char *argv[]) {
     root.links = 2; // "." and ".."
     root.size = 2 * sizeof(struct dirent);
     memset(root.direct, 0, sizeof(root.direct));
-    root.direct[0] = DATA_START_IDX;
+    root.direct[0] = sb.data_start;
     root.ctime = (uint32_t)now;
     root.mtime = (uint32_t)now;
 
-    memset(block, 0, sizeof(block));
-    memcpy(block, &root, sizeof(root));
-    write_block(fd, block); // First inode block
-
-    memset(block, 0, sizeof(block));
-    write_block(fd, block); // Second inode block
+    memcpy(inode_block, &root, sizeof(root));
+    write_block(fd, sb.inode_start, inode_block); // First inode block
 
-    memset(block, 0, sizeof(block));
-    struct dirent *root_dirents = (struct dirent *)block;
+    struct dirent *root_dirents = (struct dirent *)root_block;
     root_dirents[0].inode = 0;
     strncpy(root_dirents[0].name, ".", sizeof(root_dirents[0].name) - 1);
     root_dirents[0].name[sizeof(root_dirents[0].name) - 1] = '\0';
     root_dirents[1].inode = 0;
     strncpy(root_dirents[1].name, "..", sizeof(root_dirents[1].name) - 1);
     root_dirents[1].name[sizeof(root_dirents[1].name) - 1] = '\0';
-    write_block(fd, block); // First data block holds root directory entries
+    write_block(fd, sb.data_start, root_block); // First data block holds root directory entries
 
-    memset(block, 0, sizeof(block));
-    for (uint32_t i = 1; i < DATA_BLOCKS; ++i) {
-        write_block(fd, block);
+    // Everything else (journal log, rest of the bitmaps and inode table,
+    // free data blocks) is already zero from ftruncate
+    flush_blocks(fd);
+
+    // With full sync a valid magic only ever appears on a complete image
+    if (sync_mode == SYNC_FULL) {
+        sync_image(fd, image_size, sync_mode);
+        write_block(fd, 0, sb_block);
+        flush_blocks(fd);
+    }
+    sync_image(fd, image_size, sync_mode);
+    if (image_map) {
+        munmap(image_map, image_size);
     }
 
     if (close(fd) < 0) {
         die("close");
     }
+    if (sync_mode == SYNC_FULL) {
+        sync_parent_dir(image_path);
+    }
 
-    printf("Created VSFS image '%s' (%u blocks).\n", image_path, TOTAL_BLOCKS);
+    printf("Created VSFS image '%s' (%u blocks, %u inodes, %llu journal blocks, %llu data blocks).\n",
+           image_path, sb.total_blocks, sb.inode_count,
+           (unsigned long long)journal_blocks, (unsigned long long)data_blocks);
     return 0;
 }
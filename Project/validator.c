@@ -1,27 +1,33 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/io_uring.h>
 
 #define FS_MAGIC 0x56534653U
+#define JOURNAL_MAGIC 0x4A524E4CU
+#define FS_STATE_CLEAN 0x434C4E53U
+#define FS_FEATURE_FREE_COUNTS 0x1U
 
+#undef BLOCK_SIZE   /* <linux/fs.h>, pulled in by io_uring.h, has its own */
 #define BLOCK_SIZE        4096U
 #define INODE_SIZE         128U
-#define JOURNAL_BLOCK_IDX    1U
-#define JOURNAL_BLOCKS      16U
-#define INODE_BLOCKS         2U
-#define DATA_BLOCKS         64U
-#define INODE_BMAP_IDX     (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
-#define DATA_BMAP_IDX      (INODE_BMAP_IDX + 1U)
-#define INODE_START_IDX    (DATA_BMAP_IDX + 1U)
-#define DATA_START_IDX     (INODE_START_IDX + INODE_BLOCKS)
-#define TOTAL_BLOCKS       (DATA_START_IDX + DATA_BLOCKS)
+#define INODES_PER_BLOCK   (BLOCK_SIZE / INODE_SIZE)
+#define BITS_PER_BLOCK     (BLOCK_SIZE * 8U)
 #define DIRECT_POINTERS     8U
 #define DEFAULT_IMAGE "vsfs.img"
+/* Header plus a log of at most 2 GiB, as mkfs enforces */
+#define MAX_JOURNAL_BLOCKS (1U + (1U << 31) / BLOCK_SIZE)
 
 struct superblock {
     uint32_t magic;
@@ -35,20 +41,43 @@ struct superblock {
     uint32_t inode_start;
     uint32_t data_start;
 
-    uint8_t  _pad[128 - 9 * 4];
+    uint32_t state;     /* FS_STATE_CLEAN when the journal holds nothing to install */
+    uint32_t features;
+    uint32_t free_inodes;   /* kept when FS_FEATURE_FREE_COUNTS is set */
+    uint32_t free_blocks;
+
+    uint8_t  _pad[128 - 13 * 4];
+};
+
+/* With INODE_EXTENTS the direct pointer area holds up to four
+ * (start, length) extents in file order, and extent_block may name a data
+ * block with up to 512 more; a zero length ends either list. */
+struct extent {
+    uint32_t start;
+    uint32_t length;
 };
 
+#define INODE_EXTENTS          0x1U
+#define INODE_DIRECT_EXTENTS   4U
+#define EXTENTS_PER_BLOCK      (BLOCK_SIZE / sizeof(struct extent))
+#define INODE_MAX_EXTENTS      (INODE_DIRECT_EXTENTS + EXTENTS_PER_BLOCK)
+
 struct inode {
     uint16_t type;
     uint16_t links;
     uint32_t size;
 
-    uint32_t direct[DIRECT_POINTERS];
+    union {
+        uint32_t direct[DIRECT_POINTERS];
+        struct extent extents[INODE_DIRECT_EXTENTS];
+    };
 
     uint32_t ctime;
     uint32_t mtime;
+    uint32_t flags;
+    uint32_t extent_block;
 
-    uint8_t _pad[128 - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4)];
+    uint8_t _pad[128 - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4 + 4 + 4)];
 };
 
 struct dirent {
@@ -62,13 +91,137 @@ _Static_assert(sizeof(struct dirent) == 32, "dirent must be 32 bytes");
 
 static int error_count = 0;
 
+/* Worker threads collect their messages in per-chunk buffers that are
+ * printed in chunk order afterwards, so output does not depend on -j. */
+struct report_buf {
+    char  *text;
+    size_t len;
+    size_t cap;
+    int    errors;
+};
+
+static __thread struct report_buf *thread_report = NULL;
+
+/* Set by --mmap: the image is mapped read-only and blocks are addressed
+ * directly instead of being pread into buffers. */
+static const uint8_t *image_map = NULL;
+static size_t image_size = 0;
+
 static void die(const char *msg) {
     perror(msg);
     exit(EXIT_FAILURE);
 }
 
+/* --stats counts what is read from the image and how long the reads wait,
+ * and times each phase of the check; the lot is dumped as JSON at exit.
+ * Phase device time is summed over every thread doing the phase's reads,
+ * so with -j it can exceed the phase's wall time. Directory scans run
+ * inside check_inode on every thread; their time is summed likewise. */
+enum stat_phase {
+    PHASE_JOURNAL_REPLAY,
+    PHASE_LOAD_BITMAPS,
+    PHASE_SCAN_USED,
+    PHASE_SCAN_CHECK,
+    PHASE_DIR_SCAN,
+    PHASE_SHARED_BLOCKS,
+    PHASE_SCAN_LINKS,
+    PHASE_COMPARE_BITMAPS,
+    NPHASES,
+};
+
+static const char *const stat_phase_names[NPHASES] = {
+    "journal_replay", "load_bitmaps", "scan_used", "scan_check", "dir_scan", "shared_blocks", "scan_links", "compare_bitmaps",
+};
+
+static struct {
+    uint64_t blocks_read;
+    uint64_t bytes_read;
+    uint64_t read_calls;
+    uint64_t ring_enters;
+    uint64_t device_ns;
+    struct {
+        uint64_t count;
+        uint64_t ns;
+        uint64_t device_ns;
+    } phase[NPHASES];
+} io_stats;
+
+static int stats_enabled = 0;
+static __thread uint64_t thread_device_ns;
+
+static uint64_t stats_clock(void) {
+    if (!stats_enabled) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Counts bytes read by calls syscalls (0 when mapped or queued), and the
+ * time since start (a stats_clock value, 0 for none) spent waiting */
+static void stats_read(uint64_t bytes, uint64_t calls, uint64_t start) {
+    __atomic_fetch_add(&io_stats.blocks_read, (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&io_stats.bytes_read, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&io_stats.read_calls, calls, __ATOMIC_RELAXED);
+    if (start) {
+        uint64_t ns = stats_clock() - start;
+        thread_device_ns += ns;
+        __atomic_fetch_add(&io_stats.device_ns, ns, __ATOMIC_RELAXED);
+    }
+}
+
+struct phase_timer {
+    enum stat_phase phase;
+    uint64_t start_ns;
+    uint64_t start_device_ns;
+};
+
+static void phase_begin(struct phase_timer *t, enum stat_phase phase) {
+    t->phase = phase;
+    t->start_ns = stats_clock();
+    t->start_device_ns = __atomic_load_n(&io_stats.device_ns, __ATOMIC_RELAXED);
+}
+
+static void phase_end(const struct phase_timer *t) {
+    if (!t->start_ns) {
+        return;
+    }
+    io_stats.phase[t->phase].count++;
+    io_stats.phase[t->phase].ns += stats_clock() - t->start_ns;
+    io_stats.phase[t->phase].device_ns += __atomic_load_n(&io_stats.device_ns, __ATOMIC_RELAXED) - t->start_device_ns;
+}
+
 static void report_error(const char *fmt, ...) {
     va_list ap;
+    if (thread_report) {
+        char line[512];
+        va_start(ap, fmt);
+        int n = vsnprintf(line, sizeof(line), fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            n = 0;
+        } else if ((size_t)n >= sizeof(line)) {
+            n = (int)sizeof(line) - 1;
+        }
+        struct report_buf *rb = thread_report;
+        size_t need = rb->len + strlen("ERROR: ") + (size_t)n + 2;
+        if (need > rb->cap) {
+            size_t cap = rb->cap ? rb->cap * 2 : 1024;
+            while (cap < need) {
+                cap *= 2;
+            }
+            char *text = realloc(rb->text, cap);
+            if (!text) {
+                die("realloc report");
+            }
+            rb->text = text;
+            rb->cap = cap;
+        }
+        rb->len += (size_t)sprintf(rb->text + rb->len, "ERROR: %s\n", line);
+        rb->errors++;
+        return;
+    }
     va_start(ap, fmt);
     fputs("ERROR: ", stderr);
     vfprintf(stderr, fmt, ap);
@@ -77,65 +230,698 @@ static void report_error(const char *fmt, ...) {
     error_count++;
 }
 
-static void pread_block(int fd, uint32_t block_index, void *buf) {
+static const uint8_t *map_block(uint32_t block_index, uint32_t nblocks) {
+    size_t offset = (size_t)block_index * BLOCK_SIZE;
+    size_t len = (size_t)nblocks * BLOCK_SIZE;
+    if (offset > image_size || len > image_size - offset) {
+        fprintf(stderr, "block %u is past the end of the image\n", block_index);
+        exit(EXIT_FAILURE);
+    }
+    return image_map + offset;
+}
+
+/* Blocks of an image not marked clean, as the committed transactions in
+ * its journal leave them. Sorted by block number; every read of the image
+ * is patched with them, so the checks see what jnrl reads before those
+ * transactions are installed. The image itself is never written. */
+struct replay_block {
+    uint32_t block_no;
+    uint8_t *data;
+};
+
+static struct replay_block *replayed = NULL;
+static uint32_t nreplayed = 0;
+
+/* Index of the first replayed block at or after block_index */
+static uint32_t replay_find(uint32_t block_index) {
+    uint32_t lo = 0, hi = nreplayed;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (replayed[mid].block_no < block_index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void replay_patch(uint32_t block_index, uint32_t nblocks, uint8_t *buf) {
+    for (uint32_t i = replay_find(block_index); i < nreplayed && replayed[i].block_no - block_index < nblocks; ++i) {
+        memcpy(buf + (size_t)(replayed[i].block_no - block_index) * BLOCK_SIZE, replayed[i].data, BLOCK_SIZE);
+    }
+}
+
+static void pread_blocks(int fd, uint32_t block_index, uint32_t nblocks, void *buf) {
+    size_t len = (size_t)nblocks * BLOCK_SIZE;
+    if (image_map) {
+        memcpy(buf, map_block(block_index, nblocks), len);
+        stats_read(len, 0, 0);
+        replay_patch(block_index, nblocks, buf);
+        return;
+    }
     off_t offset = (off_t)block_index * BLOCK_SIZE;
-    ssize_t n = pread(fd, buf, BLOCK_SIZE, offset);
-    if (n != (ssize_t)BLOCK_SIZE) {
-        die("pread");
+    size_t done = 0;
+    while (done < len) {
+        uint64_t start = stats_clock();
+        ssize_t n = pread(fd, (uint8_t *)buf + done, len - done, offset + (off_t)done);
+        if (n <= 0) {
+            die("pread");
+        }
+        stats_read((uint64_t)n, 1, start);
+        done += (size_t)n;
     }
+    replay_patch(block_index, nblocks, buf);
 }
 
-static int bitmap_test(const uint8_t *bitmap, uint32_t index) {
-    return (bitmap[index / 8] >> (index % 8)) & 0x1;
+static void pread_block(int fd, uint32_t block_index, void *buf) {
+    pread_blocks(fd, block_index, 1, buf);
 }
 
-static void bitmap_check_zero_tail(const uint8_t *bitmap, uint32_t valid_bits, const char *name) {
-    uint32_t total_bits = BLOCK_SIZE * 8;
-    for (uint32_t bit = valid_bits; bit < total_bits; ++bit) {
-        if (bitmap_test(bitmap, bit)) {
-            report_error("%s bitmap has stray bit set at %u", name, bit);
+/* Unless --io=sync, every inode scan worker has a small io_uring ring, set
+ * up with raw syscalls, and keeps the read of its next chunk in flight
+ * while it checks the current one. Reads land in two registered chunk
+ * buffers, used in turn. Without a ring, chunks are pread one at a time. */
+#define SCAN_RING_ENTRIES 4U
+
+static int use_uring = 1;
+
+struct scan_ring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    int fixed;                  /* the two buffers are registered */
+    struct {
+        int busy;
+        int image_fd;
+        uint8_t *buf;
+        size_t len;
+        off_t offset;
+    } reads[2];
+};
+
+static void scan_ring_exit(struct scan_ring *r) {
+    if (r->fd < 0) {
+        return;
+    }
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    close(r->fd);
+    r->fd = -1;
+}
+
+/* Sets up a ring reading into bufs[0..1], each len bytes; -1 if the kernel
+ * will not, and the caller falls back to pread */
+static int scan_ring_setup(struct scan_ring *r, uint8_t *bufs, size_t len) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(__NR_io_uring_setup, SCAN_RING_ENTRIES, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        scan_ring_exit(r);
+        return -1;
+    }
+    r->cq_ring = r->sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            scan_ring_exit(r);
+            return -1;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        scan_ring_exit(r);
+        return -1;
+    }
+
+    uint8_t *sq = r->sq_ring;
+    uint8_t *cq = r->cq_ring;
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* Unregistered buffers work too, just with a page pin per read */
+    struct iovec fixed[2] = { { bufs, len }, { bufs + len, len } };
+    r->fixed = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, fixed, 2) == 0;
+    return 0;
+}
+
+static void scan_ring_enter(struct scan_ring *r, unsigned to_submit, unsigned min_complete) {
+    for (;;) {
+        uint64_t start = stats_clock();
+        int n = (int)syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete,
+                             min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        __atomic_fetch_add(&io_stats.ring_enters, 1, __ATOMIC_RELAXED);
+        stats_read(0, 0, start);
+        if (n >= 0) {
             return;
         }
+        if (errno != EINTR) {
+            die("io_uring_enter");
+        }
     }
 }
 
-static void validate_superblock(const struct superblock *sb) {
+/* Starts reading nblocks from block_index into buffer slot (0 or 1) */
+static void scan_ring_read(struct scan_ring *r, int image_fd, int slot, uint8_t *buf,
+                           uint32_t block_index, uint32_t nblocks) {
+    r->reads[slot].busy = 1;
+    r->reads[slot].image_fd = image_fd;
+    r->reads[slot].buf = buf;
+    r->reads[slot].len = (size_t)nblocks * BLOCK_SIZE;
+    r->reads[slot].offset = (off_t)block_index * BLOCK_SIZE;
+
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = r->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = image_fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)r->reads[slot].len;
+    sqe->off = (uint64_t)r->reads[slot].offset;
+    sqe->buf_index = (uint16_t)slot;
+    sqe->user_data = (uint64_t)slot;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    stats_read(r->reads[slot].len, 0, 0);
+    scan_ring_enter(r, 1, 0);
+}
+
+/* Waits for the read in buffer slot to finish; a short read is completed
+ * with pread */
+static void scan_ring_wait(struct scan_ring *r, int slot) {
+    while (r->reads[slot].busy) {
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            scan_ring_enter(r, 0, 1);
+            continue;
+        }
+        for (; head != tail; ++head) {
+            const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            int done = (int)cqe->user_data;
+            if (cqe->res < 0) {
+                errno = -cqe->res;
+                die("io_uring read");
+            }
+            size_t got = (size_t)cqe->res;
+            while (got < r->reads[done].len) {
+                uint64_t start = stats_clock();
+                ssize_t n = pread(r->reads[done].image_fd, r->reads[done].buf + got,
+                                  r->reads[done].len - got, r->reads[done].offset + (off_t)got);
+                if (n <= 0) {
+                    die("pread");
+                }
+                stats_read(0, 1, start);    /* the bytes were counted when queued */
+                got += (size_t)n;
+            }
+            r->reads[done].busy = 0;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/* Layout taken from the superblock; every region size is derived from the
+ * gap to the next region, so any image mkfs can build is accepted. */
+struct geometry {
+    uint32_t total_blocks;
+    uint32_t inode_count;
+    uint32_t journal_block;
+    uint32_t journal_blocks;
+    uint32_t inode_bitmap;
+    uint32_t inode_bitmap_blocks;
+    uint32_t data_bitmap;
+    uint32_t data_bitmap_blocks;
+    uint32_t inode_start;
+    uint32_t inode_blocks;
+    uint32_t data_start;
+    uint32_t data_blocks;
+};
+
+static struct geometry geo;
+
+/* State shared by the scan passes. Everything per-inode or per-block is a
+ * bitset except link_refs, which needs a (saturating) 16-bit counter. */
+static uint64_t *inode_bitmap;      /* on-disk inode bitmap */
+static uint64_t *data_bitmap;       /* on-disk data bitmap */
+static uint64_t *inode_used;        /* inodes whose type is non-zero */
+static uint64_t *data_claimed;      /* data blocks referenced by some inode */
+static uint64_t *data_dup;          /* data blocks referenced more than once */
+static uint16_t *link_refs;         /* directory entries naming each inode */
+
+static uint64_t *bitset_alloc(uint64_t nbits) {
+    uint64_t *set = calloc((size_t)((nbits + 63) / 64), sizeof(uint64_t));
+    if (!set) {
+        die("calloc bitset");
+    }
+    return set;
+}
+
+static int bitset_test(const uint64_t *set, uint64_t index) {
+    return (set[index / 64] >> (index % 64)) & 0x1;
+}
+
+/* Atomically sets a bit and returns its previous value */
+static int bitset_test_and_set(uint64_t *set, uint64_t index) {
+    uint64_t mask = 1ULL << (index % 64);
+    return (__atomic_fetch_or(&set[index / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+/* Reads an on-disk bitmap region; bit i of the image is bit i of the set */
+static uint64_t *load_bitmap(int fd, uint32_t first_block, uint32_t nblocks) {
+    uint64_t *set = malloc((size_t)nblocks * BLOCK_SIZE);
+    if (!set) {
+        die("malloc bitmap");
+    }
+    pread_blocks(fd, first_block, nblocks, set);
+    return set;
+}
+
+static void bitmap_check_zero_tail(const uint64_t *bitmap, uint64_t valid_bits, uint64_t total_bits, const char *name) {
+    for (uint64_t bit = valid_bits; bit < total_bits; ) {
+        uint64_t word = bitmap[bit / 64] >> (bit % 64);
+        if (word == 0) {
+            bit += 64 - (bit % 64);
+            continue;
+        }
+        bit += (uint64_t)__builtin_ctzll(word);
+        if (bit < total_bits) {
+            report_error("%s bitmap has stray bit set at %llu", name, (unsigned long long)bit);
+        }
+        return;
+    }
+}
+
+static int load_geometry(const struct superblock *sb, size_t image_bytes) {
     if (sb->magic != FS_MAGIC) {
         report_error("invalid superblock magic 0x%08x", sb->magic);
     }
     if (sb->block_size != BLOCK_SIZE) {
         report_error("unexpected block size %u", sb->block_size);
+        return -1;
     }
-    if (sb->total_blocks != TOTAL_BLOCKS) {
-        report_error("unexpected total blocks %u", sb->total_blocks);
+    if (sb->journal_block != 1) {
+        report_error("journal block index mismatch %u", sb->journal_block);
     }
-    uint32_t expected_inodes = INODE_BLOCKS * (BLOCK_SIZE / INODE_SIZE);
-    if (sb->inode_count != expected_inodes) {
-        report_error("unexpected inode count %u", sb->inode_count);
+    if (!(sb->journal_block < sb->inode_bitmap && sb->inode_bitmap < sb->data_bitmap &&
+          sb->data_bitmap < sb->inode_start && sb->inode_start < sb->data_start &&
+          sb->data_start <= sb->total_blocks)) {
+        report_error("superblock regions out of order (journal %u, inode bitmap %u, data bitmap %u, "
+                     "inodes %u, data %u, total %u)", sb->journal_block, sb->inode_bitmap,
+                     sb->data_bitmap, sb->inode_start, sb->data_start, sb->total_blocks);
+        return -1;
     }
-    if (sb->journal_block != JOURNAL_BLOCK_IDX) {
-        report_error("journal block index mismatch %u", sb->journal_block);
+
+    geo.total_blocks = sb->total_blocks;
+    geo.inode_count = sb->inode_count;
+    geo.journal_block = sb->journal_block;
+    geo.journal_blocks = sb->inode_bitmap - sb->journal_block;
+    geo.inode_bitmap = sb->inode_bitmap;
+    geo.inode_bitmap_blocks = sb->data_bitmap - sb->inode_bitmap;
+    geo.data_bitmap = sb->data_bitmap;
+    geo.data_bitmap_blocks = sb->inode_start - sb->data_bitmap;
+    geo.inode_start = sb->inode_start;
+    geo.inode_blocks = sb->data_start - sb->inode_start;
+    geo.data_start = sb->data_start;
+    geo.data_blocks = sb->total_blocks - sb->data_start;
+
+    int ok = 1;
+    if ((uint64_t)sb->total_blocks * BLOCK_SIZE > image_bytes) {
+        report_error("superblock claims %u blocks but image holds only %llu", sb->total_blocks,
+                     (unsigned long long)(image_bytes / BLOCK_SIZE));
+        ok = 0;
+    }
+    if (geo.journal_blocks < 2) {
+        report_error("journal region of %u blocks has no room for a log", geo.journal_blocks);
+    } else if (geo.journal_blocks > MAX_JOURNAL_BLOCKS) {
+        report_error("journal region of %u blocks exceeds the %u-block maximum", geo.journal_blocks,
+                     MAX_JOURNAL_BLOCKS);
+    }
+    if (sb->inode_count == 0 || (uint64_t)geo.inode_blocks * INODES_PER_BLOCK < sb->inode_count) {
+        report_error("unexpected inode count %u for %u inode blocks", sb->inode_count, geo.inode_blocks);
+        ok = 0;
+    }
+    if ((uint64_t)geo.inode_bitmap_blocks * BITS_PER_BLOCK < sb->inode_count) {
+        report_error("inode bitmap of %u blocks cannot cover %u inodes", geo.inode_bitmap_blocks, sb->inode_count);
+        ok = 0;
+    }
+    if ((uint64_t)geo.data_bitmap_blocks * BITS_PER_BLOCK < geo.data_blocks) {
+        report_error("data bitmap of %u blocks cannot cover %u data blocks", geo.data_bitmap_blocks, geo.data_blocks);
+        ok = 0;
+    }
+    return ok ? 0 : -1;
+}
+
+/* Journal layout as jnrl writes it: a header block, then a circular log of
+ * transactions packed back to back. Each transaction ends in a commit record
+ * carrying its sequence number and a CRC32C of its records; the first one
+ * that does not verify (stale data, or torn by a crash) ends the log. */
+struct journal_header {
+    uint32_t magic;
+    uint32_t nbytes_used;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t head_seq;
+    uint32_t tail_seq;
+    uint8_t  _pad[BLOCK_SIZE - 24];
+};
+
+#define REC_DATA    1U
+#define REC_COMMIT  2U
+#define REC_WRAP    3U
+#define REC_DELTA   4U
+
+struct rec_header {
+    uint16_t type;
+    uint16_t size;
+};
+
+struct data_record {
+    struct rec_header hdr;
+    uint32_t block_no;
+    uint8_t  data[BLOCK_SIZE];
+};
+
+struct delta_record {
+    struct rec_header hdr;
+    uint32_t block_no;
+    uint16_t offset;
+    uint16_t length;
+    uint8_t  data[];
+};
+
+struct commit_record {
+    struct rec_header hdr;
+    uint32_t seq;
+    uint32_t checksum;
+};
+
+struct wrap_record {
+    struct rec_header hdr;
+    uint32_t seq;
+};
+
+static uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78U : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+    const uint8_t *p = buf;
+    while (len--) {
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static int journal_record_valid(const struct rec_header *hdr) {
+    if (hdr->type == REC_DATA) {
+        return hdr->size == sizeof(struct data_record);
+    }
+    if (hdr->type == REC_DELTA) {
+        const struct delta_record *rec = (const struct delta_record *)hdr;
+        return hdr->size >= sizeof(struct delta_record) + rec->length &&
+               (uint32_t)rec->offset + rec->length <= BLOCK_SIZE;
+    }
+    return hdr->type == REC_COMMIT && hdr->size == sizeof(struct commit_record);
+}
+
+/* Replayed image of block_no, starting from its home copy on first use */
+static uint8_t *replay_block(int fd, uint32_t block_no) {
+    static uint32_t cap = 0;
+    uint32_t i = replay_find(block_no);
+    if (i < nreplayed && replayed[i].block_no == block_no) {
+        return replayed[i].data;
+    }
+    uint8_t *data = malloc(BLOCK_SIZE);
+    if (!data) {
+        die("malloc replay block");
+    }
+    pread_block(fd, block_no, data);
+    if (nreplayed == cap) {
+        cap = cap ? cap * 2 : 64;
+        replayed = realloc(replayed, cap * sizeof(*replayed));
+        if (!replayed) {
+            die("realloc replay blocks");
+        }
+    }
+    memmove(&replayed[i + 1], &replayed[i], (nreplayed - i) * sizeof(*replayed));
+    replayed[i].block_no = block_no;
+    replayed[i].data = data;
+    nreplayed++;
+    return data;
+}
+
+/* The log is read forward from head through a fixed window, so memory does
+ * not grow with the journal. A record is at most 64 KiB, and the window only
+ * has to hold the one being looked at: records that have scrolled out are
+ * read again if replay needs them. */
+#define LOG_WINDOW_BYTES (1U << 20)
+
+struct log_window {
+    int fd;
+    uint32_t capacity;
+    uint8_t *buf;
+    uint32_t from;      /* log offset of buf[0], a block boundary */
+    uint32_t len;       /* bytes of the log held */
+};
+
+/* Log bytes [pos, pos + len), read in if the window does not hold them.
+ * The range must not run past the end of the log. */
+static const void *log_window_get(struct log_window *w, uint32_t pos, uint32_t len) {
+    if (pos >= w->from && pos + len <= w->from + w->len) {
+        return w->buf + (pos - w->from);
+    }
+    uint32_t keep = pos / BLOCK_SIZE * BLOCK_SIZE;
+    if (keep >= w->from && keep < w->from + w->len) {
+        memmove(w->buf, w->buf + (keep - w->from), w->from + w->len - keep);
+        w->len -= keep - w->from;
+    } else {
+        w->len = 0;
+    }
+    w->from = keep;
+    uint32_t n = LOG_WINDOW_BYTES - w->len;
+    if (n > w->capacity - (w->from + w->len)) {
+        n = w->capacity - (w->from + w->len);
     }
-    if (sb->inode_bitmap != INODE_BMAP_IDX) {
-        report_error("inode bitmap index mismatch %u", sb->inode_bitmap);
+    pread_blocks(w->fd, geo.journal_block + 1 + (w->from + w->len) / BLOCK_SIZE, n / BLOCK_SIZE, w->buf + w->len);
+    w->len += n;
+    return w->buf + (pos - w->from);
+}
+
+/* Applies the records in log[from, to), one verified transaction */
+static void replay_transaction(int fd, struct log_window *w, uint32_t from, uint32_t to) {
+    for (uint32_t p = from; p < to; ) {
+        const struct rec_header *hdr = log_window_get(w, p, sizeof(*hdr));
+        hdr = log_window_get(w, p, hdr->size);
+        p += hdr->size;
+        if (hdr->type != REC_DATA && hdr->type != REC_DELTA) {
+            continue;
+        }
+        /* block_no sits at the same offset in both record types */
+        uint32_t block_no = ((const struct data_record *)hdr)->block_no;
+        if ((block_no != 0 && block_no < geo.inode_bitmap) || block_no >= geo.total_blocks) {
+            report_error("journaled block %u lies outside the superblock, bitmap, inode and data regions", block_no);
+            continue;
+        }
+        uint8_t *data = replay_block(fd, block_no);
+        if (hdr->type == REC_DATA) {
+            memcpy(data, ((const struct data_record *)hdr)->data, BLOCK_SIZE);
+        } else {
+            const struct delta_record *rec = (const struct delta_record *)hdr;
+            memcpy(data + rec->offset, rec->data, rec->length);
+        }
     }
-    if (sb->data_bitmap != DATA_BMAP_IDX) {
-        report_error("data bitmap index mismatch %u", sb->data_bitmap);
+}
+
+/* An image not marked clean may hold committed transactions that never
+ * reached their home blocks. Walks the log from head exactly as jnrl's
+ * recovery does and keeps the final image of every block they touch.
+ * Returns the number of transactions replayed. */
+static uint32_t replay_journal(int fd, const struct superblock *sb) {
+    if (sb->state == FS_STATE_CLEAN || geo.journal_blocks < 2 || geo.journal_blocks > MAX_JOURNAL_BLOCKS) {
+        return 0;
     }
-    if (sb->inode_start != INODE_START_IDX) {
-        report_error("inode start index mismatch %u", sb->inode_start);
+    struct journal_header jh;
+    pread_block(fd, geo.journal_block, &jh);
+    if (jh.magic != JOURNAL_MAGIC) {
+        /* Older mkfs builds left the journal zeroed */
+        if (jh.magic != 0) {
+            report_error("invalid journal magic 0x%08x", jh.magic);
+        }
+        return 0;
+    }
+    uint32_t capacity = (geo.journal_blocks - 1) * BLOCK_SIZE;
+    if (jh.head >= capacity || jh.head % 4 != 0) {
+        report_error("journal head %u is not a record offset in the %u-byte log", jh.head, capacity);
+        return 0;
+    }
+    struct log_window w = { fd, capacity, malloc(LOG_WINDOW_BYTES), 0, 0 };
+    if (!w.buf) {
+        die("malloc journal window");
+    }
+
+    uint32_t pos = jh.head;
+    uint32_t used = 0;
+    uint32_t seq = jh.head_seq;
+    uint32_t count = 0;
+    while (used < capacity) {
+        uint32_t skipped = 0;
+        /* The log continues at offset 0 after a REC_WRAP marker, or when
+         * there is no room left for one */
+        const struct wrap_record *wrap = NULL;
+        if (capacity - pos >= sizeof(*wrap)) {
+            wrap = log_window_get(&w, pos, sizeof(*wrap));
+        }
+        if (!wrap || wrap->hdr.type == REC_WRAP) {
+            if (pos == 0) {
+                break;
+            }
+            if (wrap && wrap->seq != seq) {
+                break;
+            }
+            skipped = capacity - pos;
+            pos = 0;
+        }
+
+        uint32_t crc = 0xFFFFFFFFU;
+        uint32_t p = pos;
+        uint32_t budget = capacity - used - skipped;
+        int committed = 0;
+        while (capacity - p >= sizeof(struct rec_header)) {
+            const struct rec_header *hdr = log_window_get(&w, p, sizeof(*hdr));
+            if (hdr->size < sizeof(struct rec_header) || hdr->size % 4 != 0 ||
+                hdr->size > capacity - p || hdr->size > budget - (p - pos)) {
+                break;
+            }
+            hdr = log_window_get(&w, p, hdr->size);
+            if (!journal_record_valid(hdr)) {
+                break;
+            }
+            if (hdr->type == REC_COMMIT) {
+                const struct commit_record *commit = (const struct commit_record *)hdr;
+                crc = crc32c_update(crc, &commit->seq, sizeof(commit->seq));
+                if (commit->seq == seq && ~crc == commit->checksum) {
+                    committed = 1;
+                    p += hdr->size;
+                }
+                break;
+            }
+            crc = crc32c_update(crc, hdr, hdr->size);
+            p += hdr->size;
+        }
+        if (!committed) {
+            break;
+        }
+        replay_transaction(fd, &w, pos, p);
+        used += skipped + (p - pos);
+        pos = p % capacity;
+        seq++;
+        count++;
+    }
+    free(w.buf);
+    return count;
+}
+
+static int data_block_in_range(uint32_t blk) {
+    return blk >= geo.data_start && blk < geo.total_blocks;
+}
+
+/* Inline extents in use; a zero length ends the list */
+static uint32_t inline_extents(const struct inode *ino) {
+    uint32_t n = 0;
+    while (n < INODE_DIRECT_EXTENTS && ino->extents[n].length != 0) {
+        ++n;
+    }
+    return n;
+}
+
+/* Collects an inode's block map as extents in file order. Direct pointers
+ * become one-block extents, with start 0 marking a hole. As in jnrl, the
+ * indirect extent block only continues a full inline list; an out-of-range
+ * one is skipped and range problems are left to the caller. */
+static int inode_extents(int fd, const struct inode *ino, struct extent *ext) {
+    int n = 0;
+    if (!(ino->flags & INODE_EXTENTS)) {
+        for (uint32_t d = 0; d < DIRECT_POINTERS; ++d) {
+            ext[n].start = ino->direct[d];
+            ext[n++].length = 1;
+        }
+        return n;
+    }
+    for (uint32_t e = 0; e < INODE_DIRECT_EXTENTS && ino->extents[e].length != 0; ++e) {
+        ext[n++] = ino->extents[e];
+    }
+    if (n == INODE_DIRECT_EXTENTS && data_block_in_range(ino->extent_block)) {
+        struct extent more[EXTENTS_PER_BLOCK];
+        pread_block(fd, ino->extent_block, more);
+        for (uint32_t e = 0; e < EXTENTS_PER_BLOCK && more[e].length != 0; ++e) {
+            ext[n++] = more[e];
+        }
     }
-    if (sb->data_start != DATA_START_IDX) {
-        report_error("data start index mismatch %u", sb->data_start);
+    return n;
+}
+
+static int extent_in_range(const struct extent *e) {
+    return data_block_in_range(e->start) &&
+           (uint64_t)e->start + e->length <= geo.total_blocks;
+}
+
+/* Disk block holding logical block lblock, or 0 for a hole or past the end */
+static uint32_t extent_lookup(const struct extent *ext, int n, uint64_t lblock) {
+    for (int x = 0; x < n; ++x) {
+        if (lblock < ext[x].length) {
+            return ext[x].start == 0 ? 0 : ext[x].start + (uint32_t)lblock;
+        }
+        lblock -= ext[x].length;
     }
+    return 0;
 }
 
 static void check_directory(int fd,
                             const struct inode *inode,
-                            uint32_t inode_index,
-                            const uint8_t *inode_used,
-                            uint32_t inode_count,
-                            uint32_t *link_refs) {
+                            uint32_t inode_index) {
     if (inode->size % sizeof(struct dirent) != 0) {
         report_error("inode %u directory size %u is not dirent-aligned", inode_index, inode->size);
         return;
@@ -146,12 +932,21 @@ static void check_directory(int fd,
     int saw_dot = 0;
     int saw_dotdot = 0;
 
-    for (uint32_t i = 0; i < DIRECT_POINTERS && bytes_remaining > 0; ++i) {
-        uint32_t blk = inode->direct[i];
+    struct extent ext[INODE_MAX_EXTENTS];
+    int next = inode_extents(fd, inode, ext);
+    uint64_t mapped = 0;
+    for (int x = 0; x < next; ++x) {
+        mapped += ext[x].length;
+    }
+    for (uint64_t lblock = 0; lblock < mapped && bytes_remaining > 0; ++lblock) {
+        uint32_t blk = extent_lookup(ext, next, lblock);
         if (blk == 0) {
             report_error("inode %u directory missing data block for bytes still remaining", inode_index);
             return;
         }
+        if (!data_block_in_range(blk)) {
+            return; /* already reported by check_inode */
+        }
         pread_block(fd, blk, block);
         uint32_t chunk = bytes_remaining > BLOCK_SIZE ? BLOCK_SIZE : bytes_remaining;
         uint32_t entries = chunk / sizeof(struct dirent);
@@ -161,11 +956,11 @@ static void check_directory(int fd,
             if (de->inode == 0 && de->name[0] == '\0') {
                 continue;
             }
-            if (de->inode >= inode_count) {
+            if (de->inode >= geo.inode_count) {
                 report_error("inode %u directory entry points to out-of-range inode %u", inode_index, de->inode);
                 continue;
             }
-            if (!inode_used[de->inode]) {
+            if (!bitset_test(inode_used, de->inode)) {
                 report_error("inode %u directory entry references free inode %u", inode_index, de->inode);
             }
             if (memchr(de->name, '\0', sizeof(de->name)) == NULL) {
@@ -176,7 +971,12 @@ static void check_directory(int fd,
                 report_error("inode %u directory entry has empty name", inode_index);
                 continue;
             }
-            link_refs[de->inode]++;
+            /* Saturate instead of wrapping; links is only 16 bits anyway */
+            uint16_t refs = __atomic_load_n(&link_refs[de->inode], __ATOMIC_RELAXED);
+            while (refs != UINT16_MAX &&
+                   !__atomic_compare_exchange_n(&link_refs[de->inode], &refs, (uint16_t)(refs + 1), 1,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
             if (strcmp(de->name, ".") == 0) {
                 if (de->inode != inode_index) {
                     report_error("inode %u '.' entry points to %u", inode_index, de->inode);
@@ -190,7 +990,7 @@ static void check_directory(int fd,
     }
 
     if (bytes_remaining != 0) {
-        report_error("inode %u directory uses more data than direct pointers cover", inode_index);
+        report_error("inode %u directory uses more data than its blocks cover", inode_index);
     }
     if (inode->size > 0) {
         if (!saw_dot) {
@@ -202,135 +1002,506 @@ static void check_directory(int fd,
     }
 }
 
-int main(int argc, char *argv[]) {
-    const char *image_path = (argc > 1) ? argv[1] : DEFAULT_IMAGE;
+/* Checks that need nothing but the inode itself and the directories it
+ * owns; safe to run for many inodes at once. */
+static void check_inode(int fd, const struct inode *ino, uint32_t i) {
+    int allocated = ino->type != 0;
+    int bitmap_bit = bitset_test(inode_bitmap, i);
+    if (allocated != bitmap_bit) {
+        report_error("inode %u allocation mismatch (inode vs bitmap)", i);
+    }
+    if (!allocated) {
+        return;
+    }
 
-    int fd = open(image_path, O_RDONLY);
-    if (fd < 0) {
-        die("open");
+    if (ino->type > 2) {
+        report_error("inode %u has invalid type %u", i, ino->type);
     }
 
-    struct superblock sb;
-    pread_block(fd, 0, &sb);
-    validate_superblock(&sb);
+    uint32_t required_blocks = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int extents = (ino->flags & INODE_EXTENTS) != 0;
+    if (ino->flags & ~INODE_EXTENTS) {
+        report_error("inode %u has unknown flags 0x%x", i, ino->flags & ~INODE_EXTENTS);
+    }
+    if (!extents && required_blocks > DIRECT_POINTERS) {
+        report_error("inode %u size %u exceeds direct pointers", i, ino->size);
+    }
+    if (ino->extent_block != 0) {
+        if (!extents) {
+            report_error("inode %u has an extent block but uses direct pointers", i);
+        } else if (!data_block_in_range(ino->extent_block)) {
+            report_error("inode %u extent block %u outside data region", i, ino->extent_block);
+        } else {
+            /* jnrl ignores it until the inline list is full; it is still
+             * claimed, since the bitmap marks it used */
+            if (inline_extents(ino) < INODE_DIRECT_EXTENTS) {
+                report_error("inode %u has extent block %u while inline extent slots are free", i,
+                             ino->extent_block);
+            }
+            if (bitset_test_and_set(data_claimed, ino->extent_block - geo.data_start)) {
+                bitset_test_and_set(data_dup, ino->extent_block - geo.data_start);
+            }
+        }
+    }
 
-    uint8_t inode_bitmap[BLOCK_SIZE];
-    uint8_t data_bitmap[BLOCK_SIZE];
-    pread_block(fd, INODE_BMAP_IDX, inode_bitmap);
-    pread_block(fd, DATA_BMAP_IDX, data_bitmap);
+    struct extent ext[INODE_MAX_EXTENTS];
+    int next = inode_extents(fd, ino, ext);
+    uint64_t seen_blocks = 0;
+    for (int x = 0; x < next; ++x) {
+        if (ext[x].start == 0 && !extents) {
+            continue;
+        }
+        seen_blocks += ext[x].length;
+        if (!extent_in_range(&ext[x])) {
+            report_error("inode %u points outside data region (block %u)", i, ext[x].start);
+            continue;
+        }
+        for (uint32_t k = 0; k < ext[x].length; ++k) {
+            uint32_t data_idx = ext[x].start + k - geo.data_start;
+            if (bitset_test_and_set(data_claimed, data_idx)) {
+                bitset_test_and_set(data_dup, data_idx);
+            }
+        }
+    }
 
-    uint32_t inode_count = sb.inode_count;
-    uint32_t total_inode_bytes = INODE_BLOCKS * BLOCK_SIZE;
-    uint8_t *inode_area = malloc(total_inode_bytes);
-    if (!inode_area) {
-        die("malloc inode area");
+    if (seen_blocks < required_blocks) {
+        report_error("inode %u lacks blocks for declared size (need %u have %llu)", i, required_blocks,
+                     (unsigned long long)seen_blocks);
+    }
+    if (required_blocks == 0 && seen_blocks > 0) {
+        report_error("inode %u has data blocks but zero size", i);
     }
-    for (uint32_t i = 0; i < INODE_BLOCKS; ++i) {
-        pread_block(fd, INODE_START_IDX + i, inode_area + (i * BLOCK_SIZE));
+
+    if (ino->type == 2) {
+        uint64_t start = stats_clock();
+        uint64_t start_device = thread_device_ns;
+        check_directory(fd, ino, i);
+        if (start) {
+            __atomic_fetch_add(&io_stats.phase[PHASE_DIR_SCAN].count, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&io_stats.phase[PHASE_DIR_SCAN].ns, stats_clock() - start, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&io_stats.phase[PHASE_DIR_SCAN].device_ns, thread_device_ns - start_device,
+                               __ATOMIC_RELAXED);
+        }
     }
-    struct inode *inodes = (struct inode *)inode_area;
+}
 
-    uint8_t inode_used[inode_count];
-    for (uint32_t i = 0; i < inode_count; ++i) {
-        inode_used[i] = (inodes[i].type != 0);
+static void check_links(const struct inode *ino, uint32_t i) {
+    if (!bitset_test(inode_used, i)) {
+        return;
     }
-    uint32_t *link_refs = calloc(inode_count, sizeof(uint32_t));
-    if (!link_refs) {
-        die("calloc link refs");
+    if (ino->links != link_refs[i]) {
+        report_error("inode %u link count %u disagrees with directory refs %u", i, ino->links, link_refs[i]);
     }
+}
 
-    int data_owner[DATA_BLOCKS];
-    memset(data_owner, -1, sizeof(data_owner));
-    uint8_t data_blocks_referenced[DATA_BLOCKS];
-    memset(data_blocks_referenced, 0, sizeof(data_blocks_referenced));
+/* The inode table is streamed in chunks of whole inode blocks. A chunk is a
+ * multiple of 64 inodes, so threads never share a word of a bitset they
+ * write without atomics. */
+#define SCAN_CHUNK_BLOCKS  32U
+#define SCAN_CHUNK_INODES  (SCAN_CHUNK_BLOCKS * INODES_PER_BLOCK)
 
-    for (uint32_t i = 0; i < inode_count; ++i) {
-        struct inode *ino = &inodes[i];
-        int allocated = ino->type != 0;
-        int bitmap_bit = bitmap_test(inode_bitmap, i);
-        if (allocated != bitmap_bit) {
-            report_error("inode %u allocation mismatch (inode vs bitmap)", i);
+enum scan_pass {
+    PASS_USED,      /* record which inodes are allocated */
+    PASS_CHECK,     /* per-inode checks, directories and block claims */
+    PASS_LINKS,     /* link counts against directory references */
+};
+
+struct inode_scan {
+    int fd;
+    enum scan_pass pass;
+    uint32_t nchunks;
+    uint32_t next_chunk;            /* claimed with an atomic fetch-add */
+    struct report_buf *reports;     /* one per chunk */
+};
+
+/* Inodes [*first, *first + *count) make up chunk, in the returned number of
+ * inode blocks */
+static uint32_t chunk_span(uint32_t chunk, uint32_t *first, uint32_t *count) {
+    *first = chunk * SCAN_CHUNK_INODES;
+    *count = geo.inode_count - *first;
+    if (*count > SCAN_CHUNK_INODES) {
+        *count = SCAN_CHUNK_INODES;
+    }
+    return (*count + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+}
+
+static void *inode_scan_worker(void *arg) {
+    struct inode_scan *scan = arg;
+    const size_t chunk_bytes = (size_t)SCAN_CHUNK_BLOCKS * BLOCK_SIZE;
+    uint8_t *buf = NULL;
+    struct scan_ring ring = { .fd = -1 };
+    /* Replayed blocks cannot be patched into the read-only mapping */
+    int zero_copy = image_map && nreplayed == 0;
+    if (!zero_copy) {
+        buf = malloc(2 * chunk_bytes);
+        if (!buf) {
+            die("malloc scan buffer");
         }
-        inode_used[i] = allocated;
-        if (!allocated) {
-            continue;
+        if (use_uring && !image_map) {
+            scan_ring_setup(&ring, buf, chunk_bytes);
         }
+    }
 
-        if (ino->type > 2) {
-            report_error("inode %u has invalid type %u", i, ino->type);
+    uint32_t first, count;
+    int cur = 0;
+    uint32_t chunk = __atomic_fetch_add(&scan->next_chunk, 1, __ATOMIC_RELAXED);
+    if (ring.fd >= 0 && chunk < scan->nchunks) {
+        scan_ring_read(&ring, scan->fd, cur, buf, geo.inode_start + chunk * SCAN_CHUNK_BLOCKS,
+                       chunk_span(chunk, &first, &count));
+    }
+    while (chunk < scan->nchunks) {
+        uint32_t next = __atomic_fetch_add(&scan->next_chunk, 1, __ATOMIC_RELAXED);
+        uint32_t nblocks = chunk_span(chunk, &first, &count);
+        uint32_t first_block = geo.inode_start + chunk * SCAN_CHUNK_BLOCKS;
+        const struct inode *inodes;
+        if (zero_copy) {
+            inodes = (const struct inode *)map_block(first_block, nblocks);
+            stats_read((uint64_t)nblocks * BLOCK_SIZE, 0, 0);
+        } else if (ring.fd >= 0) {
+            /* Claim the next chunk first so its read overlaps this one's checks */
+            if (next < scan->nchunks) {
+                uint32_t next_first, next_count;
+                scan_ring_read(&ring, scan->fd, cur ^ 1, buf + (size_t)(cur ^ 1) * chunk_bytes,
+                               geo.inode_start + next * SCAN_CHUNK_BLOCKS,
+                               chunk_span(next, &next_first, &next_count));
+            }
+            scan_ring_wait(&ring, cur);
+            replay_patch(first_block, nblocks, buf + (size_t)cur * chunk_bytes);
+            inodes = (const struct inode *)(buf + (size_t)cur * chunk_bytes);
+        } else {
+            pread_blocks(scan->fd, first_block, nblocks, buf);
+            inodes = (const struct inode *)buf;
         }
 
-        uint32_t required_blocks = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-        if (required_blocks > DIRECT_POINTERS) {
-            report_error("inode %u size %u exceeds direct pointers", i, ino->size);
+        thread_report = &scan->reports[chunk];
+        for (uint32_t k = 0; k < count; ++k) {
+            uint32_t i = first + k;
+            switch (scan->pass) {
+            case PASS_USED:
+                if (inodes[k].type != 0) {
+                    inode_used[i / 64] |= 1ULL << (i % 64);
+                }
+                break;
+            case PASS_CHECK:
+                check_inode(scan->fd, &inodes[k], i);
+                break;
+            case PASS_LINKS:
+                check_links(&inodes[k], i);
+                break;
+            }
         }
+        thread_report = NULL;
+        chunk = next;
+        cur ^= 1;
+    }
+    scan_ring_exit(&ring);
+    free(buf);
+    return NULL;
+}
 
-        uint32_t seen_blocks = 0;
-        for (uint32_t d = 0; d < DIRECT_POINTERS; ++d) {
-            uint32_t blk = ino->direct[d];
-            if (blk == 0) {
-                continue;
-            }
-            seen_blocks++;
-            if (blk < DATA_START_IDX || blk >= DATA_START_IDX + DATA_BLOCKS) {
-                report_error("inode %u points outside data region (block %u)", i, blk);
-                continue;
-            }
-            uint32_t data_idx = blk - DATA_START_IDX;
-            if (data_owner[data_idx] != -1 && data_owner[data_idx] != (int)i) {
-                report_error("data block %u referenced by both inode %d and inode %u", blk, data_owner[data_idx], i);
-            }
-            data_owner[data_idx] = (int)i;
-            data_blocks_referenced[data_idx] = 1;
+static void run_inode_pass(int fd, enum scan_pass pass, long nthreads) {
+    struct inode_scan scan = {
+        .fd = fd,
+        .pass = pass,
+        .nchunks = (geo.inode_count + SCAN_CHUNK_INODES - 1) / SCAN_CHUNK_INODES,
+        .next_chunk = 0,
+    };
+    scan.reports = calloc(scan.nchunks, sizeof(struct report_buf));
+    if (!scan.reports) {
+        die("calloc reports");
+    }
+    if ((uint32_t)nthreads > scan.nchunks) {
+        nthreads = (long)scan.nchunks;
+    }
+    pthread_t workers[nthreads];
+    for (long t = 1; t < nthreads; ++t) {
+        if (pthread_create(&workers[t], NULL, inode_scan_worker, &scan) != 0) {
+            die("pthread_create");
         }
+    }
+    inode_scan_worker(&scan);
+    for (long t = 1; t < nthreads; ++t) {
+        pthread_join(workers[t], NULL);
+    }
+    for (uint32_t c = 0; c < scan.nchunks; ++c) {
+        if (scan.reports[c].len > 0) {
+            fwrite(scan.reports[c].text, 1, scan.reports[c].len, stderr);
+        }
+        error_count += scan.reports[c].errors;
+        free(scan.reports[c].text);
+    }
+    free(scan.reports);
+}
 
-        if (seen_blocks < required_blocks) {
-            report_error("inode %u lacks blocks for declared size (need %u have %u)", i, required_blocks, seen_blocks);
+/* Names the first owner of every shared block in e next to each later one */
+static void report_shared_extent(const struct extent *e, uint32_t owner,
+                                 const uint32_t *dup_blocks, int64_t *first_owner, uint32_t ndup) {
+    for (uint32_t off = 0; off < e->length; ++off) {
+        uint32_t blk = e->start + off;
+        if (!bitset_test(data_dup, blk - geo.data_start)) {
+            continue;
         }
-        if (required_blocks == 0 && seen_blocks > 0) {
-            report_error("inode %u has data blocks but zero size", i);
+        uint32_t lo = 0, hi = ndup;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            if (dup_blocks[mid] < blk - geo.data_start) lo = mid + 1;
+            else hi = mid;
         }
+        if (first_owner[lo] == -1) {
+            first_owner[lo] = owner;
+        } else if (first_owner[lo] != (int64_t)owner) {
+            report_error("data block %u referenced by both inode %lld and inode %u",
+                         blk, (long long)first_owner[lo], owner);
+        }
+    }
+}
 
-        if (ino->type == 2) {
-            check_directory(fd, ino, i, inode_used, inode_count, link_refs);
+/* Only runs when some block is shared: walks the table in order to name the
+ * first owner of every shared block next to each later one. */
+static void report_shared_blocks(int fd) {
+    uint32_t ndup = 0;
+    for (uint32_t b = 0; b < geo.data_blocks; ++b) {
+        ndup += bitset_test(data_dup, b);
+    }
+    if (ndup == 0) {
+        return;
+    }
+    uint32_t *dup_blocks = malloc(ndup * sizeof(uint32_t));
+    int64_t *first_owner = malloc(ndup * sizeof(int64_t));
+    uint8_t *buf = malloc((size_t)SCAN_CHUNK_BLOCKS * BLOCK_SIZE);
+    if (!dup_blocks || !first_owner || !buf) {
+        die("malloc shared blocks");
+    }
+    for (uint32_t b = 0, n = 0; b < geo.data_blocks; ++b) {
+        if (bitset_test(data_dup, b)) {
+            dup_blocks[n] = b;
+            first_owner[n++] = -1;
         }
     }
 
-    for (uint32_t i = 0; i < inode_count; ++i) {
-        if (!inode_used[i]) {
-            continue;
+    for (uint32_t first = 0; first < geo.inode_count; first += SCAN_CHUNK_INODES) {
+        uint32_t count = geo.inode_count - first;
+        if (count > SCAN_CHUNK_INODES) {
+            count = SCAN_CHUNK_INODES;
         }
-        if (inodes[i].links != link_refs[i]) {
-            report_error("inode %u link count %u disagrees with directory refs %u", i, inodes[i].links, link_refs[i]);
+        uint32_t nblocks = (count + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+        pread_blocks(fd, geo.inode_start + first / INODES_PER_BLOCK, nblocks, buf);
+        const struct inode *inodes = (const struct inode *)buf;
+        for (uint32_t k = 0; k < count; ++k) {
+            if (inodes[k].type == 0) {
+                continue;
+            }
+            struct extent ext[INODE_MAX_EXTENTS + 1];
+            int next = inode_extents(fd, &inodes[k], ext);
+            if ((inodes[k].flags & INODE_EXTENTS) && inodes[k].extent_block != 0) {
+                ext[next].start = inodes[k].extent_block;
+                ext[next++].length = 1;
+            }
+            for (int x = 0; x < next; ++x) {
+                if (extent_in_range(&ext[x])) {
+                    report_shared_extent(&ext[x], first + k, dup_blocks, first_owner, ndup);
+                }
+            }
         }
     }
+    free(buf);
+    free(first_owner);
+    free(dup_blocks);
+}
 
-    for (uint32_t bit = 0; bit < inode_count; ++bit) {
-        int bit_val = bitmap_test(inode_bitmap, bit);
-        if (bit_val && !inode_used[bit]) {
-            report_error("inode bitmap marks %u used but inode is free", bit);
-        }
-        if (!bit_val && inode_used[bit]) {
-            report_error("inode bitmap misses allocated inode %u", bit);
+/* A superblock free counter must match the clear bits of its bitmap; the
+ * bitmap itself is checked against the inodes separately. */
+static void check_free_count(const uint64_t *bitmap, uint64_t nbits, uint32_t recorded, const char *what) {
+    uint64_t used = 0;
+    for (uint64_t w = 0; w < nbits / 64; ++w) {
+        used += (uint64_t)__builtin_popcountll(bitmap[w]);
+    }
+    if (nbits % 64 != 0) {
+        used += (uint64_t)__builtin_popcountll(bitmap[nbits / 64] & ((1ULL << (nbits % 64)) - 1));
+    }
+    if (recorded != nbits - used) {
+        report_error("superblock counts %u free %s but the bitmap has %llu", recorded, what,
+                     (unsigned long long)(nbits - used));
+    }
+}
+
+/* Reports every bit where the on-disk bitmap and the computed set differ */
+static void compare_bitmaps(const uint64_t *on_disk, const uint64_t *computed, uint64_t nbits,
+                            const char *marked_unused, const char *missed_used, uint32_t base) {
+    for (uint64_t w = 0; w < (nbits + 63) / 64; ++w) {
+        uint64_t diff = on_disk[w] ^ computed[w];
+        while (diff) {
+            uint64_t bit = w * 64 + (uint64_t)__builtin_ctzll(diff);
+            diff &= diff - 1;
+            if (bit >= nbits) {
+                break;
+            }
+            if (bitset_test(on_disk, bit)) {
+                report_error(marked_unused, (unsigned)(bit + base));
+            } else {
+                report_error(missed_used, (unsigned)(bit + base));
+            }
         }
     }
-    bitmap_check_zero_tail(inode_bitmap, inode_count, "inode");
+}
+
+static void stats_dump(FILE *out, const char *io, long nthreads, uint64_t elapsed_ns) {
+    fprintf(out, "{\"command\": \"validate\", \"io\": \"%s\", \"threads\": %ld, \"elapsed_ms\": %.3f,\n",
+            io, nthreads, elapsed_ns / 1e6);
+    fprintf(out, " \"device\": {\"blocks_read\": %llu, \"bytes_read\": %llu, \"read_calls\": %llu, "
+            "\"ring_enters\": %llu, \"device_ms\": %.3f},\n",
+            (unsigned long long)io_stats.blocks_read, (unsigned long long)io_stats.bytes_read,
+            (unsigned long long)io_stats.read_calls, (unsigned long long)io_stats.ring_enters,
+            io_stats.device_ns / 1e6);
+    fprintf(out, " \"phases\": {");
+    for (int p = 0; p < NPHASES; ++p) {
+        fprintf(out, "%s\"%s\": {\"count\": %llu, \"ms\": %.3f, \"device_ms\": %.3f}",
+                p ? ", " : "", stat_phase_names[p], (unsigned long long)io_stats.phase[p].count,
+                io_stats.phase[p].ns / 1e6, io_stats.phase[p].device_ns / 1e6);
+    }
+    fprintf(out, "}}\n");
+}
 
-    for (uint32_t bit = 0; bit < DATA_BLOCKS; ++bit) {
-        int bit_val = bitmap_test(data_bitmap, bit);
-        if (bit_val && !data_blocks_referenced[bit]) {
-            report_error("data bitmap marks block %u used but no inode references it", bit + DATA_START_IDX);
+int main(int argc, char *argv[]) {
+    int use_mmap = 0;
+    long nthreads = 1;
+    const char *stats_path = NULL;  /* --stats alone writes to stderr */
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "--mmap") == 0) {
+            use_mmap = 1;
+        } else if (strcmp(argv[1], "--io=sync") == 0 || strcmp(argv[1], "--io=uring") == 0) {
+            use_uring = strcmp(argv[1] + 5, "uring") == 0;
+        } else if (strcmp(argv[1], "--stats") == 0 || strncmp(argv[1], "--stats=", 8) == 0) {
+            stats_enabled = 1;
+            stats_path = argv[1][7] == '=' ? argv[1] + 8 : NULL;
+        } else if (strcmp(argv[1], "-j") == 0 && argc > 2) {
+            char *end;
+            nthreads = strtol(argv[2], &end, 10);
+            if (*end != '\0' || nthreads < 1 || nthreads > 1024) {
+                fprintf(stderr, "invalid thread count '%s'\n", argv[2]);
+                return EXIT_FAILURE;
+            }
+            argv++;
+            argc--;
+        } else {
+            fprintf(stderr, "usage: %s [--mmap] [--io=sync|uring] [--stats[=path]] [-j threads] [image]\n", argv[0]);
+            return EXIT_FAILURE;
         }
-        if (!bit_val && data_blocks_referenced[bit]) {
-            report_error("data block %u referenced but bitmap is clear", bit + DATA_START_IDX);
+        argv++;
+        argc--;
+    }
+    const char *image_path = (argc > 1) ? argv[1] : DEFAULT_IMAGE;
+    uint64_t started = stats_clock();
+    struct phase_timer timer;
+
+    int fd = open(image_path, O_RDONLY);
+    if (fd < 0) {
+        die("open");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        die("fstat");
+    }
+    image_size = (size_t)st.st_size;
+    if (use_mmap) {
+        void *map = mmap(NULL, image_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            die("mmap");
         }
+        image_map = map;
+    }
+
+    uint8_t sb_block[BLOCK_SIZE];
+    pread_block(fd, 0, sb_block);
+    struct superblock sb;
+    memcpy(&sb, sb_block, sizeof(sb));
+    if (load_geometry(&sb, image_size) < 0) {
+        fprintf(stderr, "%d inconsistencies found; superblock layout unusable, stopping.\n", error_count);
+        return 1;
+    }
+
+    phase_begin(&timer, PHASE_JOURNAL_REPLAY);
+    uint32_t replayed_txns = replay_journal(fd, &sb);
+    phase_end(&timer);
+    if (replayed_txns > 0) {
+        fprintf(stderr, "'%s' has %u journaled transaction(s) not yet installed; checking it with them replayed.\n",
+                image_path, replayed_txns);
+        /* The free counters are journaled with the allocations */
+        pread_block(fd, 0, sb_block);
+        memcpy(&sb, sb_block, sizeof(sb));
+    }
+
+    phase_begin(&timer, PHASE_LOAD_BITMAPS);
+    inode_bitmap = load_bitmap(fd, geo.inode_bitmap, geo.inode_bitmap_blocks);
+    data_bitmap = load_bitmap(fd, geo.data_bitmap, geo.data_bitmap_blocks);
+    phase_end(&timer);
+    inode_used = bitset_alloc(geo.inode_count);
+    data_claimed = bitset_alloc(geo.data_blocks);
+    data_dup = bitset_alloc(geo.data_blocks);
+    link_refs = calloc(geo.inode_count, sizeof(uint16_t));
+    if (!link_refs) {
+        die("calloc link refs");
     }
 
-    bitmap_check_zero_tail(data_bitmap, DATA_BLOCKS, "data");
+    phase_begin(&timer, PHASE_SCAN_USED);
+    run_inode_pass(fd, PASS_USED, nthreads);
+    phase_end(&timer);
+    phase_begin(&timer, PHASE_SCAN_CHECK);
+    run_inode_pass(fd, PASS_CHECK, nthreads);
+    phase_end(&timer);
+    phase_begin(&timer, PHASE_SHARED_BLOCKS);
+    report_shared_blocks(fd);
+    phase_end(&timer);
+    phase_begin(&timer, PHASE_SCAN_LINKS);
+    run_inode_pass(fd, PASS_LINKS, nthreads);
+    phase_end(&timer);
+
+    phase_begin(&timer, PHASE_COMPARE_BITMAPS);
+    compare_bitmaps(inode_bitmap, inode_used, geo.inode_count,
+                    "inode bitmap marks %u used but inode is free",
+                    "inode bitmap misses allocated inode %u", 0);
+    bitmap_check_zero_tail(inode_bitmap, geo.inode_count,
+                           (uint64_t)geo.inode_bitmap_blocks * BITS_PER_BLOCK, "inode");
+
+    compare_bitmaps(data_bitmap, data_claimed, geo.data_blocks,
+                    "data bitmap marks block %u used but no inode references it",
+                    "data block %u referenced but bitmap is clear", geo.data_start);
+    bitmap_check_zero_tail(data_bitmap, geo.data_blocks,
+                           (uint64_t)geo.data_bitmap_blocks * BITS_PER_BLOCK, "data");
+
+    if (sb.features & FS_FEATURE_FREE_COUNTS) {
+        check_free_count(inode_bitmap, geo.inode_count, sb.free_inodes, "inodes");
+        check_free_count(data_bitmap, geo.data_blocks, sb.free_blocks, "data blocks");
+    }
+    phase_end(&timer);
 
+    free(inode_bitmap);
+    free(data_bitmap);
+    free(inode_used);
+    free(data_claimed);
+    free(data_dup);
+    free(link_refs);
+    for (uint32_t i = 0; i < nreplayed; ++i) {
+        free(replayed[i].data);
+    }
+    free(replayed);
+    if (image_map) {
+        munmap((void *)image_map, image_size);
+    }
     if (close(fd) < 0) {
         die("close");
     }
+    if (stats_enabled) {
+        FILE *out = stats_path ? fopen(stats_path, "w") : stderr;
+        if (!out) {
+            die("open stats file");
+        }
+        stats_dump(out, use_mmap ? "mmap" : use_uring ? "uring" : "sync", nthreads, stats_clock() - started);
+        if (out != stderr) {
+            fclose(out);
+        }
+    }
 
     if (error_count == 0) {
         printf("Filesystem '%s' is consistent.\n", image_path);
@@ -0,0 +1,553 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/ptrace.h>
+
+/* Benchmarks the VSFS tools end to end. Every run builds a fresh image and
+ * takes it through the same pipeline:
+ *
+ *   mkfs      one image                     (op = image)
+ *   create    jnrl create-batch of N names  (op = file)
+ *   install   jnrl install of that batch    (op = file installed)
+ *   validate  validator on the result       (op = inode scanned)
+ *
+ * Each stage is timed as a whole process; its p50/p99 are taken over the
+ * runs. Bytes written to the image and the I/O calls that moved them come
+ * from the --stats report jnrl and the validator write on every timed run,
+ * into a memfd so the report itself never reaches storage: /proc/<pid>/io
+ * only sees read and write syscalls, not io_uring. mkfs has
+ * no report and does plain syscalls, so its counts come from /proc. The
+ * full syscall count needs ptrace, which would skew the timings, so it
+ * comes from one extra untimed run of the pipeline.
+ * The result is one JSON object on stdout; progress goes to stderr. */
+
+#define DEFAULT_IMAGE    "bench.img"
+#define DEFAULT_SIZE     "64M"
+#define DEFAULT_JOURNAL  "1024"
+#define DEFAULT_FILES    3000U
+#define DEFAULT_RUNS     5U
+#define MAX_TOOL_OPTS    16
+#define MAX_ARGS         (MAX_TOOL_OPTS + 16)
+
+enum stage {
+    STAGE_MKFS,
+    STAGE_CREATE,
+    STAGE_INSTALL,
+    STAGE_VALIDATE,
+    NSTAGES,
+};
+
+static const char *const stage_names[NSTAGES] = { "mkfs", "create", "install", "validate" };
+static const char *const stage_ops[NSTAGES] = { "image", "file", "file", "inode" };
+
+/* What one process run cost */
+struct sample {
+    double ms;
+    uint64_t bytes_written; /* bytes written to the image; for mkfs, to any file */
+    uint64_t io_calls;      /* reads, writes and io_uring_enter calls */
+    uint64_t write_bytes;   /* bytes the process sent towards storage */
+};
+
+struct stage_result {
+    struct sample *samples;     /* one per timed run */
+    uint64_t ops_per_run;
+    uint64_t syscalls;          /* from the traced run, 0 if none */
+};
+
+struct bench_config {
+    const char *bin_dir;
+    const char *image;
+    const char *size;
+    const char *inodes;
+    const char *journal;
+    unsigned files;
+    unsigned runs;
+    unsigned threads;
+    int count_syscalls;
+    int stats_fd;               /* memfd the tools write --stats to */
+    char stats_opt[64];         /* --stats=/proc/self/fd/<stats_fd> */
+    const char *jnrl_opts[MAX_TOOL_OPTS];
+    int njnrl_opts;
+    const char *validator_opts[MAX_TOOL_OPTS];
+    int nvalidator_opts;
+    char names_path[4096];
+};
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Picks the counters out of /proc/<pid>/io; the child must not be reaped
+ * yet. Bytes written and calls only count the syscall path. */
+static void read_proc_io(pid_t pid, struct sample *s) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return;     /* no task I/O accounting in this kernel */
+    }
+    char key[64];
+    unsigned long long value;
+    while (fscanf(f, "%63[^:]: %llu\n", key, &value) == 2) {
+        if (strcmp(key, "wchar") == 0) {
+            s->bytes_written = value;
+        } else if (strcmp(key, "write_bytes") == 0) {
+            s->write_bytes = value;
+        } else if (strcmp(key, "syscr") == 0 || strcmp(key, "syscw") == 0) {
+            s->io_calls += value;
+        }
+    }
+    fclose(f);
+}
+
+/* Value of a numeric key in the JSON object starting at obj, 0 if absent */
+static uint64_t stats_field(const char *obj, const char *key) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+    const char *end = strchr(obj, '}');
+    const char *p = strstr(obj, pattern);
+    if (!p || (end && p > end)) {
+        return 0;
+    }
+    return strtoull(p + strlen(pattern), NULL, 10);
+}
+
+/* Takes the image counters from a tool's --stats report. They cover every
+ * I/O backend, so they replace what /proc saw. */
+static void read_tool_stats(int fd, struct sample *s) {
+    char buf[8192];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n < 0) {
+        die("read --stats report");
+    }
+    buf[n] = '\0';
+    const char *device = strstr(buf, "\"device\": {");
+    if (!device) {
+        fprintf(stderr, "vsfs-bench: no device counters in the --stats report\n");
+        exit(EXIT_FAILURE);
+    }
+    s->bytes_written = stats_field(device, "bytes_written");
+    s->io_calls = stats_field(device, "read_calls") + stats_field(device, "write_calls") +
+                  stats_field(device, "ring_enters");
+}
+
+/* Follows a traced child and all of its threads to the end; returns the
+ * number of system calls they entered */
+static uint64_t trace_syscalls(pid_t child, int *status_out) {
+    int status;
+    if (waitpid(child, &status, 0) < 0 || !WIFSTOPPED(status)) {
+        die("waitpid traced child");
+    }
+    if (ptrace(PTRACE_SETOPTIONS, child, 0,
+               PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL) < 0) {
+        die("ptrace setoptions");
+    }
+    ptrace(PTRACE_SYSCALL, child, 0, 0);
+
+    uint64_t syscalls = 0;
+    for (;;) {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;      /* ECHILD: every thread is gone */
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (tid == child) {
+                *status_out = status;
+            }
+            continue;
+        }
+        int sig = 0;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            struct ptrace_syscall_info info;
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                syscalls++;
+            }
+        } else if (WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP) {
+            sig = WSTOPSIG(status);     /* a real signal: pass it on */
+        }
+        ptrace(PTRACE_SYSCALL, tid, 0, sig);
+    }
+    return syscalls;
+}
+
+/* Runs argv to completion with its stdout discarded. Fills in s when
+ * given, returns the syscall count when traced. A failing tool ends the
+ * benchmark. */
+static uint64_t run_tool(char *const argv[], struct sample *s, int traced) {
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid < 0) {
+        die("fork");
+    }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) {
+            dup2(devnull, STDOUT_FILENO);
+            close(devnull);
+        }
+        if (traced) {
+            ptrace(PTRACE_TRACEME, 0, 0, 0);
+            raise(SIGSTOP);
+        }
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    int status = 0;
+    uint64_t syscalls = 0;
+    if (traced) {
+        syscalls = trace_syscalls(pid, &status);
+    } else {
+        siginfo_t info;
+        if (waitid(P_PID, (id_t)pid, &info, WEXITED | WNOWAIT) < 0) {
+            die("waitid");
+        }
+        if (s) {
+            s->ms = now_ms() - start;
+            read_proc_io(pid, s);
+        }
+        if (waitpid(pid, &status, 0) < 0) {
+            die("waitpid");
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "vsfs-bench: '%s' failed", argv[0]);
+        for (int i = 1; argv[i]; ++i) {
+            fprintf(stderr, " %s", argv[i]);
+        }
+        fprintf(stderr, " (status %d)\n", status);
+        exit(EXIT_FAILURE);
+    }
+    return syscalls;
+}
+
+static char *tool_path(const struct bench_config *cfg, const char *tool) {
+    char *path = malloc(strlen(cfg->bin_dir) + strlen(tool) + 2);
+    if (!path) {
+        die("malloc");
+    }
+    sprintf(path, "%s/%s", cfg->bin_dir, tool);
+    return path;
+}
+
+/* Builds the command line of one stage into argv (NULL-terminated) */
+static void stage_argv(const struct bench_config *cfg, enum stage st, char **argv, char *threads_opt) {
+    int n = 0;
+    switch (st) {
+    case STAGE_MKFS:
+        argv[n++] = tool_path(cfg, "mkfs");
+        argv[n++] = "-s";
+        argv[n++] = (char *)cfg->size;
+        if (cfg->inodes) {
+            argv[n++] = "-i";
+            argv[n++] = (char *)cfg->inodes;
+        }
+        argv[n++] = "-J";
+        argv[n++] = (char *)cfg->journal;
+        argv[n++] = (char *)cfg->image;
+        break;
+    case STAGE_CREATE:
+    case STAGE_INSTALL:
+        argv[n++] = tool_path(cfg, "jnrl");
+        for (int i = 0; i < cfg->njnrl_opts; ++i) {
+            argv[n++] = (char *)cfg->jnrl_opts[i];
+        }
+        argv[n++] = (char *)cfg->stats_opt;
+        if (st == STAGE_CREATE) {
+            if (cfg->threads > 1) {
+                sprintf(threads_opt, "--threads=%u", cfg->threads);
+                argv[n++] = threads_opt;
+            }
+            argv[n++] = "create-batch";
+            argv[n++] = (char *)cfg->names_path;
+        } else {
+            argv[n++] = "install";
+        }
+        argv[n++] = (char *)cfg->image;
+        break;
+    case STAGE_VALIDATE:
+        argv[n++] = tool_path(cfg, "validator");
+        for (int i = 0; i < cfg->nvalidator_opts; ++i) {
+            argv[n++] = (char *)cfg->validator_opts[i];
+        }
+        argv[n++] = (char *)cfg->stats_opt;
+        argv[n++] = (char *)cfg->image;
+        break;
+    default:
+        break;
+    }
+    argv[n] = NULL;
+}
+
+/* One pass through the pipeline; traced passes only count syscalls */
+static void run_pipeline(const struct bench_config *cfg, struct stage_result *res, unsigned run, int traced) {
+    for (int st = 0; st < NSTAGES; ++st) {
+        char *argv[MAX_ARGS];
+        char threads_opt[32];
+        stage_argv(cfg, (enum stage)st, argv, threads_opt);
+        if (st == STAGE_MKFS) {
+            unlink(cfg->image);
+        }
+        if (traced) {
+            res[st].syscalls = run_tool(argv, NULL, 1);
+        } else {
+            if (ftruncate(cfg->stats_fd, 0) < 0) {
+                die("truncate --stats report");
+            }
+            run_tool(argv, &res[st].samples[run], 0);
+            if (st != STAGE_MKFS) {
+                read_tool_stats(cfg->stats_fd, &res[st].samples[run]);
+            }
+        }
+        free(argv[0]);
+    }
+}
+
+static void write_names(const struct bench_config *cfg) {
+    FILE *f = fopen(cfg->names_path, "w");
+    if (!f) {
+        die("create names file");
+    }
+    for (unsigned i = 0; i < cfg->files; ++i) {
+        fprintf(f, "bench%07u\n", i);
+    }
+    if (fclose(f) != 0) {
+        die("write names file");
+    }
+}
+
+/* Reads the inode count back from the superblock mkfs wrote */
+static uint64_t image_inode_count(const char *image) {
+    uint32_t sb[4];
+    int fd = open(image, O_RDONLY);
+    if (fd < 0 || pread(fd, sb, sizeof(sb), 0) != (ssize_t)sizeof(sb)) {
+        die("read superblock");
+    }
+    close(fd);
+    return sb[3];
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of n sorted values */
+static double percentile(const double *sorted, unsigned n, unsigned pct) {
+    unsigned rank = (pct * n + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void print_json_string(const char *s) {
+    putchar('"');
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            putchar('\\');
+        }
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+static void print_results(const struct bench_config *cfg, const struct stage_result *res) {
+    printf("{\n  \"config\": {\"size\": ");
+    print_json_string(cfg->size);
+    printf(", \"inodes\": ");
+    if (cfg->inodes) {
+        print_json_string(cfg->inodes);
+    } else {
+        printf("null");
+    }
+    printf(", \"journal_blocks\": ");
+    print_json_string(cfg->journal);
+    printf(", \"files\": %u, \"runs\": %u, \"threads\": %u, \"jnrl_opts\": [", cfg->files, cfg->runs, cfg->threads);
+    for (int i = 0; i < cfg->njnrl_opts; ++i) {
+        printf(i ? ", " : "");
+        print_json_string(cfg->jnrl_opts[i]);
+    }
+    printf("], \"validator_opts\": [");
+    for (int i = 0; i < cfg->nvalidator_opts; ++i) {
+        printf(i ? ", " : "");
+        print_json_string(cfg->validator_opts[i]);
+    }
+    printf("]},\n  \"results\": [\n");
+
+    double *ms = malloc(cfg->runs * sizeof(double));
+    if (!ms) {
+        die("malloc");
+    }
+    for (int st = 0; st < NSTAGES; ++st) {
+        const struct stage_result *r = &res[st];
+        double total_ms = 0;
+        uint64_t bytes_written = 0, write_bytes = 0, io_calls = 0;
+        for (unsigned i = 0; i < cfg->runs; ++i) {
+            ms[i] = r->samples[i].ms;
+            total_ms += ms[i];
+            bytes_written += r->samples[i].bytes_written;
+            write_bytes += r->samples[i].write_bytes;
+            io_calls += r->samples[i].io_calls;
+        }
+        qsort(ms, cfg->runs, sizeof(double), cmp_double);
+        printf("    {\"workload\": \"%s\", \"op\": \"%s\", \"ops_per_run\": %llu, "
+               "\"ops_per_sec\": %.1f, \"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p99_ms\": %.3f, "
+               "\"bytes_written\": %llu, \"storage_bytes_written\": %llu, "
+               "\"io_calls\": %llu, \"syscalls\": ",
+               stage_names[st], stage_ops[st], (unsigned long long)r->ops_per_run,
+               total_ms > 0 ? r->ops_per_run * cfg->runs / (total_ms / 1e3) : 0.0,
+               total_ms / cfg->runs, percentile(ms, cfg->runs, 50), percentile(ms, cfg->runs, 99),
+               (unsigned long long)(bytes_written / cfg->runs), (unsigned long long)(write_bytes / cfg->runs),
+               (unsigned long long)(io_calls / cfg->runs));
+        if (cfg->count_syscalls) {
+            printf("%llu}", (unsigned long long)r->syscalls);
+        } else {
+            printf("null}");
+        }
+        printf(st + 1 < NSTAGES ? ",\n" : "\n");
+    }
+    printf("  ]\n}\n");
+    free(ms);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-s size] [-i inodes] [-J journal-blocks] [-n files] [-r runs] [-t threads]\n"
+            "       [-B bin-dir] [-o image] [-X jnrl-option]... [-V validator-option]... [--no-syscalls]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+static unsigned parse_count(const char *text, const char *what, unsigned max) {
+    char *end;
+    unsigned long v = strtoul(text, &end, 10);
+    if (*end != '\0' || v < 1 || v > max) {
+        fprintf(stderr, "invalid %s '%s'\n", what, text);
+        exit(EXIT_FAILURE);
+    }
+    return (unsigned)v;
+}
+
+int main(int argc, char *argv[]) {
+    const char *prog = argv[0];
+    struct bench_config cfg = {
+        .bin_dir = ".",
+        .image = DEFAULT_IMAGE,
+        .size = DEFAULT_SIZE,
+        .journal = DEFAULT_JOURNAL,
+        .files = DEFAULT_FILES,
+        .runs = DEFAULT_RUNS,
+        .threads = 1,
+        .count_syscalls = 1,
+    };
+
+    while (argc > 1 && argv[1][0] == '-') {
+        const char *opt = argv[1];
+        if (strcmp(opt, "--no-syscalls") == 0) {
+            cfg.count_syscalls = 0;
+            argv++;
+            argc--;
+            continue;
+        }
+        if (argc < 3 || strlen(opt) != 2) {
+            usage(prog);
+        }
+        const char *val = argv[2];
+        switch (opt[1]) {
+        case 's': cfg.size = val; break;
+        case 'i': cfg.inodes = val; break;
+        case 'J': cfg.journal = val; break;
+        case 'n': cfg.files = parse_count(val, "file count", 10000000); break;
+        case 'r': cfg.runs = parse_count(val, "run count", 10000); break;
+        case 't': cfg.threads = parse_count(val, "thread count", 256); break;
+        case 'B': cfg.bin_dir = val; break;
+        case 'o': cfg.image = val; break;
+        case 'X':
+            if (cfg.njnrl_opts == MAX_TOOL_OPTS) {
+                usage(prog);
+            }
+            cfg.jnrl_opts[cfg.njnrl_opts++] = val;
+            break;
+        case 'V':
+            if (cfg.nvalidator_opts == MAX_TOOL_OPTS) {
+                usage(prog);
+            }
+            cfg.validator_opts[cfg.nvalidator_opts++] = val;
+            break;
+        default:
+            usage(prog);
+        }
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc > 1) {
+        usage(prog);
+    }
+    if ((size_t)snprintf(cfg.names_path, sizeof(cfg.names_path), "%s.names", cfg.image) >= sizeof(cfg.names_path)) {
+        fprintf(stderr, "image path too long\n");
+        return EXIT_FAILURE;
+    }
+    cfg.stats_fd = memfd_create("vsfs-bench-stats", 0);
+    if (cfg.stats_fd < 0) {
+        die("memfd_create");
+    }
+    snprintf(cfg.stats_opt, sizeof(cfg.stats_opt), "--stats=/proc/self/fd/%d", cfg.stats_fd);
+
+    struct stage_result res[NSTAGES];
+    memset(res, 0, sizeof(res));
+    for (int st = 0; st < NSTAGES; ++st) {
+        res[st].samples = calloc(cfg.runs, sizeof(struct sample));
+        if (!res[st].samples) {
+            die("calloc samples");
+        }
+    }
+    write_names(&cfg);
+
+    for (unsigned run = 0; run < cfg.runs; ++run) {
+        run_pipeline(&cfg, res, run, 0);
+        fprintf(stderr, "run %u/%u:", run + 1, cfg.runs);
+        for (int st = 0; st < NSTAGES; ++st) {
+            fprintf(stderr, " %s %.1f ms", stage_names[st], res[st].samples[run].ms);
+        }
+        fputc('\n', stderr);
+    }
+    if (cfg.count_syscalls) {
+        fprintf(stderr, "counting syscalls (traced run)\n");
+        run_pipeline(&cfg, res, 0, 1);
+    }
+
+    res[STAGE_MKFS].ops_per_run = 1;
+    res[STAGE_CREATE].ops_per_run = cfg.files;
+    res[STAGE_INSTALL].ops_per_run = cfg.files;
+    res[STAGE_VALIDATE].ops_per_run = image_inode_count(cfg.image);
+    print_results(&cfg, res);
+
+    unlink(cfg.names_path);
+    unlink(cfg.image);
+    close(cfg.stats_fd);
+    for (int st = 0; st < NSTAGES; ++st) {
+        free(res[st].samples);
+    }
+    return 0;
+}